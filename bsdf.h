@@ -0,0 +1,95 @@
+#pragma once
+
+// a direction drawn from a BSDF, with its value and solid angle density
+struct BSDFSample
+{
+	float3 wi;
+	float3 f;
+	float pdf;
+};
+
+class BSDFUtils {
+public:
+	// orthonormal basis around N without trigonometry or normalization
+	// reference: Duff et al., Building an Orthonormal Basis, Revisited (JCGT 2017)
+	static void CreateBasis(const float3 N, float3& T, float3& B)
+	{
+		const float sign = copysignf(1.0f, N.z);
+		const float a = -1.0f / (sign + N.z);
+		const float b = N.x * N.y * a;
+		T = float3(1.0f + sign * N.x * N.x * a, sign * b, -sign * N.x);
+		B = float3(b, sign + N.y * N.y * a, -N.y);
+	}
+
+	static float3 ToWorld(const float3 v, const float3 N)
+	{
+		float3 T, B;
+		CreateBasis(N, T, B);
+		return v.x * T + v.y * B + v.z * N;
+	}
+
+	// cosine-weighted hemisphere: a uniform point on the unit disk, lifted to the hemisphere
+	static float3 SampleCosineHemisphere(const float3 N, const float r0, const float r1)
+	{
+		const float r = sqrtf(r0), phi = 2 * PI * r1;
+		return ToWorld(float3(r * cosf(phi), r * sinf(phi), sqrtf(fmaxf(0.0f, 1 - r0))), N);
+	}
+
+	static float CosineHemispherePdf(const float cosTheta) { return cosTheta > 0 ? cosTheta * INVPI : 0; }
+
+	// BSDF interface used by the path tracer; all lobes are Lambertian for now.
+	// A glossy lobe adds a case to Eval, Pdf and Sample, keyed on the material.
+	static float3 Eval(const Material& material, const float3 N, const float3 wo, const float3 wi, const float3 albedo)
+	{
+		return dot(N, wi) > 0 ? albedo * INVPI : float3(0);
+	}
+
+	static float Pdf(const Material& material, const float3 N, const float3 wo, const float3 wi)
+	{
+		return CosineHemispherePdf(dot(N, wi));
+	}
+
+	static BSDFSample Sample(const Material& material, const float3 N, const float3 wo, const float3 albedo, const float r0, const float r1)
+	{
+		BSDFSample s;
+		s.wi = SampleCosineHemisphere(N, r0, r1);
+		s.f = Eval(material, N, wo, s.wi, albedo);
+		s.pdf = Pdf(material, N, wo, s.wi);
+		return s;
+	}
+
+	// unpolarized Fresnel reflectance, for k = cos^2 of the transmitted angle
+	static float Fresnel(const float cosI, const float k, const float n1, const float n2)
+	{
+		const float cosT = sqrtf(k);
+		const float Rs = ((n1 * cosI) - (n2 * cosT)) / ((n1 * cosI) + (n2 * cosT));
+		const float Rp = ((n1 * cosT) - (n2 * cosI)) / ((n1 * cosT) + (n2 * cosI));
+		return ((Rs * Rs) + (Rp * Rp)) / 2;
+	}
+
+	// glass and mirrors: the next direction of a ray D, which is weighted by the
+	// albedo alone; false for diffuse materials
+	static bool SampleSpecular(const Material& material, const float3 N, const float3 D, const float r, float3& direction)
+	{
+		//refraction of glass: 1.52 
+		float n1 = 1;
+		float n2 = 1.52f;
+		float n1DividedByn2 = n1 / n2;
+		float cosI = dot(N, -D);
+		float k = 1 - (((n1 / n2) * (n1 / n2)) * (1 - (cosI * cosI)));
+
+		if (material.isGlass && !(k < 0))
+		{
+			// glass: reflect with probability Fr, refract otherwise
+			const float Fr = Fresnel(cosI, k, n1, n2);
+			direction = r < Fr ? reflect(D, N) : (n1DividedByn2 * D) + (N * ((n1DividedByn2 * cosI) - sqrt(k)));
+			return true;
+		}
+		if (material.isMirror || material.isGlass)
+		{
+			direction = reflect(D, N);
+			return true;
+		}
+		return false;
+	}
+};
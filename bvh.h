@@ -1,9 +1,39 @@
 #pragma once
+#define MAX_PRIMITIVE_TYPES 8
+
 namespace Tmpl8 {
 	struct BVHNode
 	{
 		float3 aabbMin, aabbMax;
 		uint leftNode, firstPrimIdx, primCount;
+		uint visibility; // OR of the visibility flags of all primitives below
+	};
+
+	// eight TriAccel records in SoA layout, tested against one ray at once
+	struct TriAccel8
+	{
+		__m256 r0x, r0y, r0z, r0w, r1x, r1y, r1z, r1w, r2x, r2y, r2z, r2w;
+		__m256i visibility; // zero for empty lanes
+		int objIdx[8];
+		int count;
+	};
+
+	// eight spheres (world-space center and squared radius) in SoA layout
+	struct Sphere8
+	{
+		__m256 cx, cy, cz, r2;
+		__m256i visibility; // zero for empty lanes
+		int objIdx[8];
+		int count;
+	};
+
+	// per-leaf ranges into the bundle arrays; primitives that are not
+	// bundled are listed in the rest array, grouped per primitive type
+	struct LeafPack
+	{
+		uint firstTriBundle, triBundleCount;
+		uint firstSphereBundle, sphereBundleCount;
+		uint firstRest[MAX_PRIMITIVE_TYPES], restCount[MAX_PRIMITIVE_TYPES];
 	};
 
 	struct AABB
@@ -34,7 +34,7 @@ public:
 		const float3 height = (imagePlaneBL - imagePlaneTL) * fovFactor;
 		const float3 P = origin + u * width + v * height;
 
-		return Ray( camPos, normalize( P - camPos ) );
+		return Ray( camPos, normalize( P - camPos ), 1e34f, VIS_CAMERA );
 	}
 	Ray GetPrimaryRay(const float x, const float y)
 	{
@@ -47,7 +47,22 @@ public:
 		const float3 height = (imagePlaneBL - imagePlaneTL) * fovFactor;
 		const float3 P = origin + u * width + v * height;
 
-		return Ray(camPos, normalize(P - camPos));
+		return Ray(camPos, normalize(P - camPos), 1e34f, VIS_CAMERA);
+	}
+	// inverse of GetPrimaryRay: the fractional pixel coordinates whose ray passes
+	// through P; false when P is behind the camera
+	bool Project(const float3 P, float2& pixel) const
+	{
+		const float fovFactor = tan(fov / 2 * PI / 180) * 2;
+		const float3 origin = imagePlaneTL * fovFactor;
+		const float3 width = (imagePlaneTR - imagePlaneTL) * fovFactor;
+		const float3 height = (imagePlaneBL - imagePlaneTL) * fovFactor;
+		const float3 N = cross(width, height);
+		const float s = dot(origin - camPos, N) / dot(P - camPos, N);
+		if (!(s > 0)) return false;
+		const float3 Q = camPos + (P - camPos) * s - origin;
+		pixel = float2(dot(Q, width) / dot(width, width) * SCRWIDTH, dot(Q, height) / dot(height, height) * SCRHEIGHT);
+		return true;
 	}
 	void Rotate(const int offsetX, const int offsetY)
 	{
@@ -0,0 +1,207 @@
+#pragma once
+
+// comment out to run the filter one pixel at a time
+#define DENOISER_SIMD
+
+namespace Tmpl8 {
+	// primary hit attributes per pixel, as a structure of arrays for the SIMD filter
+	struct GBuffer
+	{
+		void Init(int w, int h)
+		{
+			width = w, height = h;
+			const size_t size = (size_t)w * h * sizeof(float);
+			nx = (float*)MALLOC64(size), ny = (float*)MALLOC64(size), nz = (float*)MALLOC64(size);
+			depth = (float*)MALLOC64(size);
+			albedoR = (float*)MALLOC64(size), albedoG = (float*)MALLOC64(size), albedoB = (float*)MALLOC64(size);
+			objIdx = (int*)MALLOC64(size);
+		}
+
+		// not a destructor: the renderer swaps buffers by value
+		void Free()
+		{
+			FREE64(nx), FREE64(ny), FREE64(nz), FREE64(depth);
+			FREE64(albedoR), FREE64(albedoG), FREE64(albedoB), FREE64(objIdx);
+		}
+
+		void Store(int pixel, const float3 N, const float t, const float3 albedo, const int id)
+		{
+			nx[pixel] = N.x, ny[pixel] = N.y, nz[pixel] = N.z;
+			depth[pixel] = t;
+			albedoR[pixel] = albedo.x, albedoG[pixel] = albedo.y, albedoB[pixel] = albedo.z;
+			objIdx[pixel] = id;
+		}
+
+		float *nx, *ny, *nz, *depth, *albedoR, *albedoG, *albedoB;
+		int* objIdx;
+		int width = 0, height = 0;
+	};
+
+	// edge-aware a-trous wavelet filter (Dammertz et al. 2010) on demodulated
+	// irradiance; the luminance edge stopping scales with the standard error of
+	// each pixel's mean, as in SVGF (Schied et al. 2017), so the filter fades out
+	// as the accumulation converges
+	class Denoiser
+	{
+	public:
+		void Init(int w, int h)
+		{
+			width = w, height = h;
+			const size_t size = (size_t)w * h * sizeof(float);
+			for (int i = 0; i < 2; i++)
+			{
+				r[i] = (float*)MALLOC64(size), g[i] = (float*)MALLOC64(size), b[i] = (float*)MALLOC64(size);
+				var[i] = (float*)MALLOC64(size);
+			}
+		}
+
+		void Free()
+		{
+			for (int i = 0; i < 2; i++) FREE64(r[i]), FREE64(g[i]), FREE64(b[i]), FREE64(var[i]);
+		}
+
+		void Filter(const float4* color, const uint* sampleCount, const float* m2, const GBuffer& gbuffer, float4* out)
+		{
+			// divide out the primary albedo: texture detail is not noise
+			#pragma omp parallel for
+			for (int y = 0; y < height; y++) for (int i = y * width; i < (y + 1) * width; i++)
+			{
+				const float ar = max(gbuffer.albedoR[i], 1e-3f), ag = max(gbuffer.albedoG[i], 1e-3f), ab = max(gbuffer.albedoB[i], 1e-3f);
+				r[0][i] = color[i].x / ar, g[0][i] = color[i].y / ag, b[0][i] = color[i].z / ab;
+				const float albedoLum = max(Luminance(ar, ag, ab), 1e-3f);
+				var[0][i] = sampleCount[i] > 1 ? m2[i] / ((sampleCount[i] - 1.0f) * sampleCount[i]) / (albedoLum * albedoLum) : 1e4f;
+			}
+			int src = 0;
+			for (int i = 0; i < iterations; i++, src ^= 1)
+			{
+				const int step = 1 << i;
+				#pragma omp parallel for schedule(dynamic)
+				for (int y = 0; y < height; y++)
+				{
+					int x = 0;
+#ifdef DENOISER_SIMD
+					// 8 pixels at a time where all taps of the row are inside the image
+					for (; x < 2 * step && x < width; x++) FilterPixel(x, y, step, src, gbuffer);
+					for (; x + 8 + 2 * step <= width; x += 8) FilterBlock8(x, y, step, src, gbuffer);
+#endif
+					for (; x < width; x++) FilterPixel(x, y, step, src, gbuffer);
+				}
+			}
+			#pragma omp parallel for
+			for (int y = 0; y < height; y++) for (int i = y * width; i < (y + 1) * width; i++)
+				out[i] = float4(r[src][i] * max(gbuffer.albedoR[i], 1e-3f), g[src][i] * max(gbuffer.albedoG[i], 1e-3f), b[src][i] * max(gbuffer.albedoB[i], 1e-3f), 0);
+		}
+
+		int iterations = 5;
+		float sigmaNormal = 128;	// exponent on the normal dot product, rounded up to a power of two
+		float sigmaDepth = 0.02f;	// relative depth change per pixel of distance
+		float sigmaLuminance = 4;	// in standard errors of the mean
+
+	private:
+		static float Luminance(const float r, const float g, const float b) { return 0.2126f * r + 0.7152f * g + 0.0722f * b; }
+
+		void FilterPixel(const int x, const int y, const int step, const int src, const GBuffer& gb)
+		{
+			const float kernel[3] = { 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+			const int p = x + y * width, dst = src ^ 1;
+			const float lum = Luminance(r[src][p], g[src][p], b[src][p]);
+			const float invSigmaL = 1 / (sigmaLuminance * sqrtf(var[src][p]) + 1e-4f);
+			const float invSigmaZ = 1 / (sigmaDepth * gb.depth[p] * step);
+			float wSum = kernel[0] * kernel[0];
+			float sumR = r[src][p] * wSum, sumG = g[src][p] * wSum, sumB = b[src][p] * wSum, sumV = var[src][p] * wSum * wSum;
+			for (int ky = -2; ky <= 2; ky++)
+			{
+				const int qy = y + ky * step;
+				if (qy < 0 || qy >= height) continue;
+				for (int kx = -2; kx <= 2; kx++)
+				{
+					const int qx = x + kx * step;
+					if ((kx == 0 && ky == 0) || qx < 0 || qx >= width) continue;
+					const int q = qx + qy * width;
+					if (gb.objIdx[q] != gb.objIdx[p]) continue;
+					float wn = max(0.0f, gb.nx[p] * gb.nx[q] + gb.ny[p] * gb.ny[q] + gb.nz[p] * gb.nz[q]);
+					for (float e = 1; e < sigmaNormal; e *= 2) wn *= wn;
+					const float dz = fabs(gb.depth[p] - gb.depth[q]) * invSigmaZ / (abs(kx) + abs(ky));
+					const float dl = fabs(lum - Luminance(r[src][q], g[src][q], b[src][q])) * invSigmaL;
+					const float w = kernel[abs(kx)] * kernel[abs(ky)] * wn * expf(-(dz + dl));
+					sumR += r[src][q] * w, sumG += g[src][q] * w, sumB += b[src][q] * w, sumV += var[src][q] * w * w;
+					wSum += w;
+				}
+			}
+			const float invW = 1 / wSum;
+			r[dst][p] = sumR * invW, g[dst][p] = sumG * invW, b[dst][p] = sumB * invW;
+			var[dst][p] = sumV * invW * invW;
+		}
+
+		static inline __m256 Luminance8(const __m256 r, const __m256 g, const __m256 b)
+		{
+			return _mm256_fmadd_ps(r, _mm256_set1_ps(0.2126f), _mm256_fmadd_ps(g, _mm256_set1_ps(0.7152f), _mm256_mul_ps(b, _mm256_set1_ps(0.0722f))));
+		}
+
+		static inline __m256 Abs8(const __m256 x) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x); }
+
+		// e^x for x <= 0: 2^integer part through the exponent bits, 2^fraction by a
+		// polynomial (relative error below 2e-4, plenty for a filter weight)
+		static inline __m256 FastExp8(__m256 x)
+		{
+			x = _mm256_max_ps(_mm256_mul_ps(x, _mm256_set1_ps(1.44269504f)), _mm256_set1_ps(-126.0f));
+			const __m256 fi = _mm256_floor_ps(x), f = _mm256_sub_ps(x, fi);
+			__m256 p = _mm256_fmadd_ps(_mm256_set1_ps(0.0790209f), f, _mm256_set1_ps(0.2249187f));
+			p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.6960656f));
+			p = _mm256_fmadd_ps(p, f, _mm256_set1_ps(0.9999892f));
+			const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(fi), _mm256_set1_epi32(127)), 23);
+			return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+		}
+
+		void FilterBlock8(const int x, const int y, const int step, const int src, const GBuffer& gb)
+		{
+			const float kernel[3] = { 3.0f / 8, 1.0f / 4, 1.0f / 16 };
+			const int p = x + y * width, dst = src ^ 1;
+			const __m256 cr = _mm256_loadu_ps(r[src] + p), cg = _mm256_loadu_ps(g[src] + p), cb = _mm256_loadu_ps(b[src] + p);
+			const __m256 cv = _mm256_loadu_ps(var[src] + p);
+			const __m256 cnx = _mm256_loadu_ps(gb.nx + p), cny = _mm256_loadu_ps(gb.ny + p), cnz = _mm256_loadu_ps(gb.nz + p);
+			const __m256 cz = _mm256_loadu_ps(gb.depth + p);
+			const __m256i cid = _mm256_loadu_si256((const __m256i*)(gb.objIdx + p));
+			const __m256 lum = Luminance8(cr, cg, cb);
+			const __m256 invSigmaL = _mm256_div_ps(_mm256_set1_ps(1), _mm256_fmadd_ps(_mm256_set1_ps(sigmaLuminance), _mm256_sqrt_ps(cv), _mm256_set1_ps(1e-4f)));
+			const __m256 invSigmaZ = _mm256_div_ps(_mm256_set1_ps(1), _mm256_mul_ps(_mm256_set1_ps(sigmaDepth * step), cz));
+			const __m256 w0 = _mm256_set1_ps(kernel[0] * kernel[0]);
+			__m256 wSum = w0;
+			__m256 sumR = _mm256_mul_ps(cr, w0), sumG = _mm256_mul_ps(cg, w0), sumB = _mm256_mul_ps(cb, w0);
+			__m256 sumV = _mm256_mul_ps(cv, _mm256_mul_ps(w0, w0));
+			for (int ky = -2; ky <= 2; ky++)
+			{
+				const int qy = y + ky * step;
+				if (qy < 0 || qy >= height) continue;
+				for (int kx = -2; kx <= 2; kx++)
+				{
+					if (kx == 0 && ky == 0) continue;
+					const int q = x + kx * step + qy * width;
+					const __m256 qr = _mm256_loadu_ps(r[src] + q), qg = _mm256_loadu_ps(g[src] + q), qb = _mm256_loadu_ps(b[src] + q);
+					const __m256i qid = _mm256_loadu_si256((const __m256i*)(gb.objIdx + q));
+					const __m256 sameObject = _mm256_castsi256_ps(_mm256_cmpeq_epi32(cid, qid));
+					__m256 wn = _mm256_mul_ps(cnx, _mm256_loadu_ps(gb.nx + q));
+					wn = _mm256_fmadd_ps(cny, _mm256_loadu_ps(gb.ny + q), wn);
+					wn = _mm256_fmadd_ps(cnz, _mm256_loadu_ps(gb.nz + q), wn);
+					wn = _mm256_max_ps(wn, _mm256_setzero_ps());
+					for (float e = 1; e < sigmaNormal; e *= 2) wn = _mm256_mul_ps(wn, wn);
+					const __m256 dz = _mm256_mul_ps(_mm256_mul_ps(Abs8(_mm256_sub_ps(cz, _mm256_loadu_ps(gb.depth + q))), invSigmaZ), _mm256_set1_ps(1.0f / (abs(kx) + abs(ky))));
+					const __m256 dl = _mm256_mul_ps(Abs8(_mm256_sub_ps(lum, Luminance8(qr, qg, qb))), invSigmaL);
+					__m256 w = _mm256_mul_ps(_mm256_set1_ps(kernel[abs(kx)] * kernel[abs(ky)]), wn);
+					w = _mm256_and_ps(_mm256_mul_ps(w, FastExp8(_mm256_sub_ps(_mm256_setzero_ps(), _mm256_add_ps(dz, dl)))), sameObject);
+					sumR = _mm256_fmadd_ps(qr, w, sumR), sumG = _mm256_fmadd_ps(qg, w, sumG), sumB = _mm256_fmadd_ps(qb, w, sumB);
+					sumV = _mm256_fmadd_ps(_mm256_loadu_ps(var[src] + q), _mm256_mul_ps(w, w), sumV);
+					wSum = _mm256_add_ps(wSum, w);
+				}
+			}
+			const __m256 invW = _mm256_div_ps(_mm256_set1_ps(1), wSum);
+			_mm256_storeu_ps(r[dst] + p, _mm256_mul_ps(sumR, invW));
+			_mm256_storeu_ps(g[dst] + p, _mm256_mul_ps(sumG, invW));
+			_mm256_storeu_ps(b[dst] + p, _mm256_mul_ps(sumB, invW));
+			_mm256_storeu_ps(var[dst] + p, _mm256_mul_ps(sumV, _mm256_mul_ps(invW, invW)));
+		}
+
+		int width = 0, height = 0;
+		float* r[2], * g[2], * b[2], * var[2];
+	};
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+namespace Tmpl8 {
+	// an emissive primitive in the light registry
+	struct Light
+	{
+		int objIdx;
+		float3 emission;
+		float area, power;
+		float3 center;
+		AABB bounds;
+		uint treePath, treeDepth; // branches taken from the light BVH root to this light
+	};
+
+	// Vose's alias method: constant time selection proportional to a weight
+	class AliasTable
+	{
+	public:
+		void Build(const vector<float>& weights)
+		{
+			int n = (int)weights.size();
+			prob.resize(n), alias.resize(n), pmf.resize(n);
+			float sum = 0;
+			for (float w : weights) sum += w;
+			vector<float> scaled(n);
+			vector<int> small, large;
+			for (int i = 0; i < n; i++)
+			{
+				pmf[i] = sum > 0 ? weights[i] / sum : 1.0f / n;
+				scaled[i] = pmf[i] * n, alias[i] = i;
+				(scaled[i] < 1 ? small : large).push_back(i);
+			}
+			while (!small.empty() && !large.empty())
+			{
+				int s = small.back(), l = large.back();
+				small.pop_back(), large.pop_back();
+				prob[s] = scaled[s], alias[s] = l;
+				scaled[l] = (scaled[l] + scaled[s]) - 1;
+				(scaled[l] < 1 ? small : large).push_back(l);
+			}
+			// leftovers are 1 up to rounding
+			for (int i : small) prob[i] = 1;
+			for (int i : large) prob[i] = 1;
+		}
+
+		int Sample(float r) const
+		{
+			float x = r * prob.size();
+			int i = min((int)x, (int)prob.size() - 1);
+			return x - i < prob[i] ? i : alias[i];
+		}
+
+		vector<float> prob, pmf;
+		vector<int> alias;
+	};
+
+	struct LightBVHNode
+	{
+		float3 aabbMin, aabbMax;
+		float power;
+		uint leftNode, lightIdx; // leaf: leftNode == 0
+	};
+
+	// binary tree over the lights; a light is picked by walking down and choosing
+	// a child proportional to its estimated contribution at the shading point
+	class LightTree
+	{
+	public:
+		void Build(vector<Light>& lights)
+		{
+			nodes.clear();
+			if (lights.empty()) return;
+			vector<uint> lightIdx(lights.size());
+			for (uint i = 0; i < lightIdx.size(); i++) lightIdx[i] = i;
+			nodes.reserve(lights.size() * 2 - 1);
+			nodes.push_back(LightBVHNode{});
+			Subdivide(lights, lightIdx, 0, 0, (uint)lights.size(), 0, 0);
+		}
+
+		void Subdivide(vector<Light>& lights, vector<uint>& lightIdx, uint nodeIdx, uint first, uint count, uint path, uint depth)
+		{
+			AABB bounds, centers;
+			float power = 0;
+			for (uint i = first; i < first + count; i++)
+			{
+				Light& light = lights[lightIdx[i]];
+				bounds.grow(light.bounds.bmin), bounds.grow(light.bounds.bmax);
+				centers.grow(light.center);
+				power += light.power;
+			}
+			LightBVHNode& node = nodes[nodeIdx];
+			node.aabbMin = bounds.bmin, node.aabbMax = bounds.bmax, node.power = power;
+			if (count == 1)
+			{
+				node.leftNode = 0, node.lightIdx = lightIdx[first];
+				lights[lightIdx[first]].treePath = path, lights[lightIdx[first]].treeDepth = depth;
+				return;
+			}
+			// median split over the widest axis of the light centers
+			float3 e = centers.bmax - centers.bmin;
+			int axis = e.x > e.y && e.x > e.z ? 0 : e.y > e.z ? 1 : 2;
+			uint half = count / 2;
+			nth_element(lightIdx.begin() + first, lightIdx.begin() + first + half, lightIdx.begin() + first + count,
+				[&](uint a, uint b) { return lights[a].center[axis] < lights[b].center[axis]; });
+			uint leftChildIdx = (uint)nodes.size();
+			nodes[nodeIdx].leftNode = leftChildIdx;
+			nodes.push_back(LightBVHNode{}), nodes.push_back(LightBVHNode{});
+			Subdivide(lights, lightIdx, leftChildIdx, first, half, path, depth + 1);
+			Subdivide(lights, lightIdx, leftChildIdx + 1, first + half, count - half, path | (1u << depth), depth + 1);
+		}
+
+		static float Importance(const LightBVHNode& node, const float3 I, const float3 N)
+		{
+			// power over squared distance, clamped inside the box; zero when the
+			// box lies entirely below the surface
+			float3 e = node.aabbMax - node.aabbMin;
+			float3 d = (node.aabbMin + node.aabbMax) * 0.5f - I;
+			if (dot(d, N) + 0.5f * dot(e, fabs(N)) <= 0) return 0;
+			return node.power / max(dot(d, d), dot(e, e) * 0.25f);
+		}
+
+		int Sample(const float3 I, const float3 N, float r, float& pmf) const
+		{
+			uint nodeIdx = 0;
+			pmf = 1;
+			while (nodes[nodeIdx].leftNode != 0)
+			{
+				uint left = nodes[nodeIdx].leftNode;
+				float wl = Importance(nodes[left], I, N), wr = Importance(nodes[left + 1], I, N);
+				if (wl + wr <= 0) return -1;
+				float pl = wl / (wl + wr);
+				// reuse the random number for the next level
+				if (r < pl) r = r / pl, pmf *= pl, nodeIdx = left;
+				else r = min((r - pl) / (1 - pl), 0.99999994f), pmf *= 1 - pl, nodeIdx = left + 1;
+			}
+			return (int)nodes[nodeIdx].lightIdx;
+		}
+
+		float Pmf(const float3 I, const float3 N, const Light& light) const
+		{
+			// probability that Sample picks this light: replay its path from the root
+			uint nodeIdx = 0;
+			float pmf = 1;
+			for (uint i = 0; i < light.treeDepth; i++)
+			{
+				uint left = nodes[nodeIdx].leftNode;
+				float wl = Importance(nodes[left], I, N), wr = Importance(nodes[left + 1], I, N);
+				if (wl + wr <= 0) return 0;
+				uint right = (light.treePath >> i) & 1;
+				pmf *= (right ? wr : wl) / (wl + wr);
+				nodeIdx = left + right;
+			}
+			return pmf;
+		}
+
+		vector<LightBVHNode> nodes;
+	};
+
+	class LightUtils {
+	public:
+		// uniform point on the surface of an emissive triangle, sphere or quad
+		static bool CanSample(const Primitive& p) { return p.type == 0 || p.type == 1 || p.type == 4; }
+
+		static float Area(const Primitive& p)
+		{
+			if (p.type == 0)
+			{
+				float3 v0 = TransformPosition(p.tri.vertex0, p.T);
+				float3 v1 = TransformPosition(p.tri.vertex1, p.T);
+				float3 v2 = TransformPosition(p.tri.vertex2, p.T);
+				return 0.5f * length(cross(v1 - v0, v2 - v0));
+			}
+			if (p.type == 1) return 4 * PI * p.tri.vertex0.y;
+			float size = p.tri.vertex0.x * 2;
+			return size * size;
+		}
+
+		static void SamplePoint(const Primitive& p, const float r0, const float r1, float3& P, float3& N)
+		{
+			if (p.type == 0)
+			{
+				float3 v0 = TransformPosition(p.tri.vertex0, p.T);
+				float3 v1 = TransformPosition(p.tri.vertex1, p.T);
+				float3 v2 = TransformPosition(p.tri.vertex2, p.T);
+				float s = sqrtf(r0);
+				P = v0 * (1 - s) + v1 * (s * (1 - r1)) + v2 * (s * r1);
+				N = normalize(cross(v1 - v0, v2 - v0));
+			}
+			else if (p.type == 1)
+			{
+				float z = 1 - 2 * r0, r = sqrtf(max(0.0f, 1 - z * z)), phi = 2 * PI * r1;
+				N = float3(r * cosf(phi), r * sinf(phi), z);
+				P = TransformPosition(float3(0), p.T) + N * p.tri.vertex0.x;
+			}
+			else
+			{
+				float size = p.tri.vertex0.x;
+				P = TransformPosition(float3((r0 * 2 - 1) * size, 0, (r1 * 2 - 1) * size), p.T);
+				N = normalize(TransformVector(float3(0, 1, 0), p.T));
+			}
+		}
+	};
+}
@@ -1,4 +1,8 @@
 #pragma once
+
+// comment out to resolve sorted groups of floor and logo hits one at a time
+#define MATERIAL_SIMD
+
 struct Material
 {
 public:
@@ -16,7 +20,7 @@ public:
 
 class MaterialUtils {
 public:
-	static float3 GetAlbedo(Material& material, const float3 I) 
+	static float3 GetAlbedo(const Material& material, const float3 I, const float2 uv = float2(0))
 	{
 		switch (material.solverId)
 		{
@@ -30,7 +34,7 @@ public:
 		}
 	}
 
-	static float3 SolveFloorMaterial(Material& material, const float3 I)
+	static float3 SolveFloorMaterial(const Material& material, const float3 I)
 	{
 		// floor albedo: checkerboard
 		int ix = (int)(I.x * 2 + 96.01f);
@@ -41,15 +45,57 @@ public:
 		return material.color * float3(((ix + iz) & 1) ? 1 : 0.3f);
 	}
 
-	static float3 SolveBackWallMaterial(Material& material, const float3 I)
+	static Surface& Logo()
+	{
+		static Surface logo("assets/logo.png");
+		return logo;
+	}
+
+	static float3 SolveBackWallMaterial(const Material& material, const float3 I)
 	{
 		// floor albedo: checkerboard
 		// back wall: logo
-		static Surface logo("assets/logo.png");
+		const Surface& logo = Logo();
 		int ix = (int)((I.x + 4) * (128.0f / 8));
 		int iy = (int)((2 - I.y) * (64.0f / 3));
 		uint p = logo.pixels[(ix & 127) + (iy & 63) * 128];
 		uint3 i3((p >> 16) & 255, (p >> 8) & 255, p & 255);
 		return float3(i3) * (1.0f / 255.0f);
 	}
+
+	// eight hits of the same material at once, as SolveFloorMaterial and
+	// SolveBackWallMaterial; positions and albedos as a structure of arrays
+	static void SolveFloorMaterial8(const Material& material, const float* x, const float* z, float* r, float* g, float* b)
+	{
+		const __m256 px = _mm256_loadu_ps(x), pz = _mm256_loadu_ps(z);
+		__m256i ix = _mm256_cvttps_epi32(_mm256_fmadd_ps(px, _mm256_set1_ps(2), _mm256_set1_ps(96.01f)));
+		__m256i iz = _mm256_cvttps_epi32(_mm256_fmadd_ps(pz, _mm256_set1_ps(2), _mm256_set1_ps(96.01f)));
+		// the two aliased tiles
+		const __m256i onZ = _mm256_cmpeq_epi32(iz, _mm256_set1_epi32(98));
+		const __m256i tile32 = _mm256_and_si256(onZ, _mm256_cmpeq_epi32(ix, _mm256_set1_epi32(98)));
+		const __m256i tile64 = _mm256_and_si256(onZ, _mm256_cmpeq_epi32(ix, _mm256_set1_epi32(94)));
+		const __m256 scale = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_set1_ps(0), _mm256_set1_ps(32.01f), _mm256_castsi256_ps(tile32)), _mm256_set1_ps(64.01f), _mm256_castsi256_ps(tile64));
+		const __m256 aliased = _mm256_castsi256_ps(_mm256_or_si256(tile32, tile64));
+		ix = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(ix), _mm256_castsi256_ps(_mm256_cvttps_epi32(_mm256_mul_ps(px, scale))), aliased));
+		iz = _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(iz), _mm256_castsi256_ps(_mm256_cvttps_epi32(_mm256_mul_ps(pz, scale))), aliased));
+		const __m256i odd = _mm256_and_si256(_mm256_add_epi32(ix, iz), _mm256_set1_epi32(1));
+		const __m256 f = _mm256_blendv_ps(_mm256_set1_ps(0.3f), _mm256_set1_ps(1), _mm256_castsi256_ps(_mm256_cmpeq_epi32(odd, _mm256_set1_epi32(1))));
+		_mm256_storeu_ps(r, _mm256_mul_ps(f, _mm256_set1_ps(material.color.x)));
+		_mm256_storeu_ps(g, _mm256_mul_ps(f, _mm256_set1_ps(material.color.y)));
+		_mm256_storeu_ps(b, _mm256_mul_ps(f, _mm256_set1_ps(material.color.z)));
+	}
+
+	static void SolveBackWallMaterial8(const Material& material, const float* x, const float* y, float* r, float* g, float* b)
+	{
+		const Surface& logo = Logo();
+		const __m256i ix = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_add_ps(_mm256_loadu_ps(x), _mm256_set1_ps(4)), _mm256_set1_ps(128.0f / 8)));
+		const __m256i iy = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(2), _mm256_loadu_ps(y)), _mm256_set1_ps(64.0f / 3)));
+		const __m256i index = _mm256_add_epi32(_mm256_and_si256(ix, _mm256_set1_epi32(127)), _mm256_slli_epi32(_mm256_and_si256(iy, _mm256_set1_epi32(63)), 7));
+		const __m256i p = _mm256_i32gather_epi32((const int*)logo.pixels, index, 4);
+		const __m256i byte = _mm256_set1_epi32(255);
+		const __m256 inv = _mm256_set1_ps(1.0f / 255.0f);
+		_mm256_storeu_ps(r, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 16), byte)), inv));
+		_mm256_storeu_ps(g, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(p, 8), byte)), inv));
+		_mm256_storeu_ps(b, _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(p, byte)), inv));
+	}
 };
\ No newline at end of file
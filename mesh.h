@@ -0,0 +1,466 @@
+#pragma once
+
+// -----------------------------------------------------------
+// mesh.h
+// Indexed triangle mesh with its own BVH. The scene places a
+// mesh as a single primitive (MeshKernel), so the top-level
+// BVH only sees its bounds. Vertices are shared between
+// triangles; a triangle costs 12 bytes of indices.
+// Meshes load from OBJ (parsed in parallel) or from a compact
+// binary file that is mapped into memory as-is, BVH included.
+// -----------------------------------------------------------
+
+#define MESH_MAGIC 0x3148534d // "MSH1"
+#define MESH_MAX_DEPTH 64		// BVH depth limit, and the size of the traversal stack
+
+namespace Tmpl8 {
+
+	struct MeshFileHeader
+	{
+		uint magic, vertexCount, triCount, nodeCount;
+	};
+
+	class Mesh
+	{
+	public:
+		Mesh() = default;
+		Mesh(const Mesh&) = delete;
+		~Mesh()
+		{
+#ifdef _WIN32
+			if (mapping) UnmapViewOfFile(mapping);
+#else
+			free(mapping);
+#endif
+		}
+
+		bool LoadOBJ(const char* file)
+		{
+			FILE* f = fopen(file, "rb");
+			if (!f) return false;
+			size_t size = FileLength(f);
+			vector<char> text(size + 1);
+			size_t bytesRead = fread(text.data(), 1, size, f);
+			fclose(f);
+			text[bytesRead] = '\n';
+			// split the file into chunks that start at a line boundary
+			const int chunkCount = 64;
+			size_t chunkStart[chunkCount + 1];
+			chunkStart[0] = 0, chunkStart[chunkCount] = bytesRead;
+			for (int i = 1; i < chunkCount; i++)
+			{
+				size_t pos = max(chunkStart[i - 1], bytesRead * i / chunkCount);
+				while (pos < bytesRead && text[pos] != '\n') pos++;
+				chunkStart[i] = min(pos + 1, bytesRead);
+			}
+			// pass 1: count vertices and triangles per chunk
+			uint chunkVerts[chunkCount + 1] = {}, chunkTris[chunkCount + 1] = {};
+#pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < chunkCount; i++)
+				ParseChunk(&text[chunkStart[i]], &text[chunkStart[i + 1]], 0, 0, chunkVerts[i + 1], chunkTris[i + 1]);
+			for (int i = 0; i < chunkCount; i++) chunkVerts[i + 1] += chunkVerts[i], chunkTris[i + 1] += chunkTris[i];
+			if (chunkTris[chunkCount] == 0) return false;
+			// pass 2: parse into the final buffers at the chunk offsets
+			vertexData.resize(chunkVerts[chunkCount]);
+			indexData.resize(chunkTris[chunkCount] * 3);
+			vertices = vertexData.data(), vertexCount = (uint)vertexData.size();
+			indices = indexData.data(), triCount = (uint)indexData.size() / 3;
+#pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < chunkCount; i++)
+			{
+				uint v = chunkVerts[i], t = chunkTris[i];
+				ParseChunk(&text[chunkStart[i]], &text[chunkStart[i + 1]], vertexData.data(), indexData.data(), v, t);
+			}
+			// clamp broken indices instead of crashing on them
+			for (uint i = 0; i < triCount * 3; i++) if (indices[i] >= vertexCount) indices[i] = 0;
+			BuildBVH();
+			return true;
+		}
+
+		bool LoadBinary(const char* file)
+		{
+			// the file is used in place: header, vertices, indices, BVH nodes, BVH indices
+#ifdef _WIN32
+			HANDLE f = CreateFileA(file, GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+			if (f == INVALID_HANDLE_VALUE) return false;
+			LARGE_INTEGER fileSize;
+			if (!GetFileSizeEx(f, &fileSize) || fileSize.QuadPart < (LONGLONG)sizeof(MeshFileHeader)) { CloseHandle(f); return false; }
+			const uint64_t size = (uint64_t)fileSize.QuadPart;
+			HANDLE m = CreateFileMappingA(f, 0, PAGE_READONLY, 0, 0, 0);
+			CloseHandle(f);
+			if (!m) return false;
+			mapping = MapViewOfFile(m, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(m);
+			if (!mapping) return false;
+#else
+			FILE* f = fopen(file, "rb");
+			if (!f) return false;
+			const uint64_t size = FileLength(f);
+			if (size < sizeof(MeshFileHeader)) { fclose(f); return false; }
+			mapping = malloc(size);
+			size_t bytesRead = fread(mapping, 1, size, f);
+			fclose(f);
+			if (bytesRead != size) return false;
+#endif
+			MeshFileHeader& header = *(MeshFileHeader*)mapping;
+			if (header.magic != MESH_MAGIC) return false;
+			// a truncated or foreign file must not be read past its end
+			const uint64_t expected = sizeof(MeshFileHeader) + (uint64_t)header.vertexCount * sizeof(float3) +
+				(uint64_t)header.triCount * 3 * sizeof(uint) + (uint64_t)header.nodeCount * sizeof(BVHNode) + (uint64_t)header.triCount * sizeof(uint);
+			if (size != expected || header.triCount == 0 || header.nodeCount == 0) return false;
+			vertexCount = header.vertexCount, triCount = header.triCount, nodesUsed = header.nodeCount;
+			vertices = (float3*)(&header + 1);
+			indices = (uint*)(vertices + vertexCount);
+			bvhNode = (BVHNode*)(indices + triCount * 3);
+			triIdx = (uint*)(bvhNode + nodesUsed);
+			if (!CheckBVH()) return false;
+			UpdateBounds();
+			return true;
+		}
+
+		bool SaveBinary(const char* file) const
+		{
+			FILE* f = fopen(file, "wb");
+			if (!f) return false;
+			MeshFileHeader header = { MESH_MAGIC, vertexCount, triCount, nodesUsed };
+			fwrite(&header, sizeof(header), 1, f);
+			fwrite(vertices, sizeof(float3), vertexCount, f);
+			fwrite(indices, sizeof(uint), triCount * 3, f);
+			fwrite(bvhNode, sizeof(BVHNode), nodesUsed, f);
+			fwrite(triIdx, sizeof(uint), triCount, f);
+			fclose(f);
+			return true;
+		}
+
+		void BuildBVH()
+		{
+			nodeData.resize(triCount * 2 - 1);
+			triIdxData.resize(triCount);
+			centroids.resize(triCount);
+			bvhNode = nodeData.data(), triIdx = triIdxData.data();
+#pragma omp parallel for
+			for (int i = 0; i < (int)triCount; i++)
+			{
+				triIdx[i] = i;
+				centroids[i] = (Vertex(i, 0) + Vertex(i, 1) + Vertex(i, 2)) * (1.0f / 3);
+			}
+			BVHNode& root = bvhNode[0];
+			root.leftNode = 0, root.firstPrimIdx = 0, root.primCount = triCount;
+			nodesUsed = 1;
+			UpdateNodeBounds(0);
+			Subdivide(0, 0);
+			vector<float3>().swap(centroids);
+			// room was made for the worst case of one triangle per leaf
+			nodeData.resize(nodesUsed), nodeData.shrink_to_fit();
+			bvhNode = nodeData.data();
+			UpdateBounds();
+		}
+
+		void Intersect(Ray& ray) const
+		{
+			// stack-based traversal, nearest child first; a node at depth d has at most
+			// d entries on the stack, and the tree is at most MESH_MAX_DEPTH deep
+			const BVHNode* node = &bvhNode[0], * stack[MESH_MAX_DEPTH];
+			uint stackPtr = 0;
+			while (1)
+			{
+				if (node->primCount > 0)
+				{
+					for (uint i = 0; i < node->primCount; i++) IntersectTri(triIdx[node->firstPrimIdx + i], ray);
+					if (stackPtr == 0) break; else node = stack[--stackPtr];
+					continue;
+				}
+				const BVHNode* child1 = &bvhNode[node->leftNode], * child2 = &bvhNode[node->leftNode + 1];
+				float dist1 = IntersectAABB(ray, child1->aabbMin, child1->aabbMax);
+				float dist2 = IntersectAABB(ray, child2->aabbMin, child2->aabbMax);
+				if (dist1 > dist2) swap(dist1, dist2), swap(child1, child2);
+				if (dist1 == 1e30f)
+				{
+					if (stackPtr == 0) break; else node = stack[--stackPtr];
+				}
+				else
+				{
+					node = child1;
+					if (dist2 != 1e30f) stack[stackPtr++] = child2;
+				}
+			}
+		}
+
+		float3 GetNormal(uint tri) const
+		{
+			return normalize(cross(Vertex(tri, 1) - Vertex(tri, 0), Vertex(tri, 2) - Vertex(tri, 0)));
+		}
+
+		float3 Vertex(uint tri, int i) const { return vertices[indices[tri * 3 + i]]; }
+
+		size_t MemoryUsage() const
+		{
+			return vertexCount * sizeof(float3) + triCount * 3 * sizeof(uint) + nodesUsed * sizeof(BVHNode) + triCount * sizeof(uint);
+		}
+
+		// shared vertex buffer, three indices per triangle
+		float3* vertices = 0;
+		uint* indices = 0;
+		uint vertexCount = 0, triCount = 0;
+		// BVH over the triangles of this mesh, in object space
+		BVHNode* bvhNode = 0;
+		uint* triIdx = 0;
+		uint nodesUsed = 0;
+		AABB bounds;
+
+	private:
+		static uint64_t FileLength(FILE* f)
+		{
+			// ftell returns a long, which is 32 bits on Windows
+#ifdef _WIN32
+			_fseeki64(f, 0, SEEK_END);
+			const uint64_t size = (uint64_t)_ftelli64(f);
+			_fseeki64(f, 0, SEEK_SET);
+#else
+			fseeko(f, 0, SEEK_END);
+			const uint64_t size = (uint64_t)ftello(f);
+			fseeko(f, 0, SEEK_SET);
+#endif
+			return size;
+		}
+
+		bool CheckBVH() const
+		{
+			// a damaged file must not send traversal outside the arrays or past
+			// the end of its stack; every node is visited once in a valid tree
+			struct Entry { uint node, depth; } stack[MESH_MAX_DEPTH + 1];
+			uint stackPtr = 0, visited = 0;
+			stack[stackPtr++] = { 0, 0 };
+			while (stackPtr > 0)
+			{
+				const Entry e = stack[--stackPtr];
+				const BVHNode& node = bvhNode[e.node];
+				if (++visited > nodesUsed) return false;
+				if (node.primCount > 0)
+				{
+					if ((uint64_t)node.firstPrimIdx + node.primCount > triCount) return false;
+					continue;
+				}
+				if (e.depth >= MESH_MAX_DEPTH || node.leftNode == 0 || node.leftNode >= nodesUsed - 1) return false;
+				stack[stackPtr++] = { node.leftNode, e.depth + 1 };
+				stack[stackPtr++] = { node.leftNode + 1, e.depth + 1 };
+			}
+			return true;
+		}
+
+		static const char* SkipSpace(const char* p) { while (*p == ' ' || *p == '\t') p++; return p; }
+
+		static const char* ParseFloat(const char* p, float& value)
+		{
+			p = SkipSpace(p);
+			float sign = 1, result = 0;
+			if (*p == '-') sign = -1, p++; else if (*p == '+') p++;
+			while (*p >= '0' && *p <= '9') result = result * 10 + (*p++ - '0');
+			if (*p == '.')
+			{
+				float scale = 0.1f;
+				for (p++; *p >= '0' && *p <= '9'; p++) result += (*p - '0') * scale, scale *= 0.1f;
+			}
+			if (*p == 'e' || *p == 'E')
+			{
+				int exponent = 0, expSign = 1;
+				p++;
+				if (*p == '-') expSign = -1, p++; else if (*p == '+') p++;
+				while (*p >= '0' && *p <= '9') exponent = exponent * 10 + (*p++ - '0');
+				result *= powf(10.0f, (float)(exponent * expSign));
+			}
+			value = sign * result;
+			return p;
+		}
+
+		static const char* ParseIndex(const char* p, int& value, bool& found)
+		{
+			// 'v', 'v/vt', 'v//vn' or 'v/vt/vn': only the position index is used
+			p = SkipSpace(p);
+			int sign = 1, result = 0;
+			if (*p == '-') sign = -1, p++;
+			found = *p >= '0' && *p <= '9';
+			while (*p >= '0' && *p <= '9') result = result * 10 + (*p++ - '0');
+			while (*p && *p != ' ' && *p != '\t' && *p != '\n' && *p != '\r') p++;
+			value = sign * result;
+			return p;
+		}
+
+		// counts when vertexOut is 0; v and t are the running vertex and triangle counts
+		static void ParseChunk(const char* p, const char* end, float3* vertexOut, uint* indexOut, uint& v, uint& t)
+		{
+			while (p < end)
+			{
+				if (p[0] == 'v' && (p[1] == ' ' || p[1] == '\t'))
+				{
+					if (vertexOut)
+					{
+						float3& V = vertexOut[v];
+						p = ParseFloat(p + 2, V.x), p = ParseFloat(p, V.y), p = ParseFloat(p, V.z);
+					}
+					v++;
+				}
+				else if (p[0] == 'f' && (p[1] == ' ' || p[1] == '\t'))
+				{
+					// triangulate polygons as a fan; negative indices are relative
+					int first = 0, prev = 0, idx, count = 0;
+					bool found;
+					for (p = ParseIndex(p + 2, idx, found); found; p = ParseIndex(p, idx, found))
+					{
+						uint vi = idx < 0 ? (uint)((int)v + idx) : (uint)(idx - 1);
+						if (count == 0) first = vi;
+						else if (count >= 2)
+						{
+							if (indexOut) indexOut[t * 3] = first, indexOut[t * 3 + 1] = prev, indexOut[t * 3 + 2] = vi;
+							t++;
+						}
+						prev = vi, count++;
+					}
+				}
+				while (p < end && *p != '\n') p++;
+				p++;
+			}
+		}
+
+		void UpdateBounds()
+		{
+			bounds = AABB();
+			bounds.grow(bvhNode[0].aabbMin), bounds.grow(bvhNode[0].aabbMax);
+		}
+
+		void UpdateNodeBounds(uint nodeIdx)
+		{
+			BVHNode& node = bvhNode[nodeIdx];
+			node.aabbMin = float3(1e30f), node.aabbMax = float3(-1e30f);
+			for (uint i = 0; i < node.primCount; i++)
+			{
+				uint tri = triIdx[node.firstPrimIdx + i];
+				for (int j = 0; j < 3; j++)
+				{
+					float3 V = Vertex(tri, j);
+					node.aabbMin = fminf(node.aabbMin, V), node.aabbMax = fmaxf(node.aabbMax, V);
+				}
+			}
+		}
+
+		float FindBestSplitPlane(BVHNode& node, int& axis, float& splitPos)
+		{
+			// binned SAH: a full sweep per candidate is far too slow for large meshes
+			const int BINS = 8;
+			float bestCost = 1e30f;
+			for (int a = 0; a < 3; a++)
+			{
+				float boundsMin = 1e30f, boundsMax = -1e30f;
+				for (uint i = 0; i < node.primCount; i++)
+				{
+					float c = centroids[triIdx[node.firstPrimIdx + i]][a];
+					boundsMin = min(boundsMin, c), boundsMax = max(boundsMax, c);
+				}
+				if (boundsMin == boundsMax) continue;
+				AABB bin[BINS];
+				uint binCount[BINS] = {};
+				float scale = BINS / (boundsMax - boundsMin);
+				for (uint i = 0; i < node.primCount; i++)
+				{
+					uint tri = triIdx[node.firstPrimIdx + i];
+					int b = min(BINS - 1, (int)((centroids[tri][a] - boundsMin) * scale));
+					binCount[b]++;
+					bin[b].grow(Vertex(tri, 0)), bin[b].grow(Vertex(tri, 1)), bin[b].grow(Vertex(tri, 2));
+				}
+				float leftArea[BINS - 1], rightArea[BINS - 1];
+				uint leftCount[BINS - 1], rightCount[BINS - 1];
+				AABB leftBox, rightBox;
+				uint leftSum = 0, rightSum = 0;
+				for (int i = 0; i < BINS - 1; i++)
+				{
+					leftSum += binCount[i], leftCount[i] = leftSum;
+					leftBox.grow(bin[i].bmin), leftBox.grow(bin[i].bmax);
+					leftArea[i] = leftBox.area();
+					rightSum += binCount[BINS - 1 - i], rightCount[BINS - 2 - i] = rightSum;
+					rightBox.grow(bin[BINS - 1 - i].bmin), rightBox.grow(bin[BINS - 1 - i].bmax);
+					rightArea[BINS - 2 - i] = rightBox.area();
+				}
+				scale = (boundsMax - boundsMin) / BINS;
+				for (int i = 0; i < BINS - 1; i++)
+				{
+					if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+					float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+					if (cost < bestCost) axis = a, splitPos = boundsMin + scale * (i + 1), bestCost = cost;
+				}
+			}
+			return bestCost;
+		}
+
+		void Subdivide(uint nodeIdx, uint depth)
+		{
+			BVHNode& node = bvhNode[nodeIdx];
+			if (depth >= MESH_MAX_DEPTH) return;
+			int axis = 0;
+			float splitPos = 0;
+			float splitCost = FindBestSplitPlane(node, axis, splitPos);
+			float3 e = node.aabbMax - node.aabbMin;
+			float parentCost = node.primCount * (e.x * e.y + e.y * e.z + e.z * e.x);
+			if (splitCost >= parentCost) return;
+			// in-place partition
+			int i = node.firstPrimIdx;
+			int j = i + node.primCount - 1;
+			while (i <= j)
+			{
+				if (centroids[triIdx[i]][axis] < splitPos) i++;
+				else swap(triIdx[i], triIdx[j--]);
+			}
+			uint leftCount = i - node.firstPrimIdx;
+			if (leftCount == 0 || leftCount == node.primCount) return;
+			int leftChildIdx = nodesUsed++;
+			int rightChildIdx = nodesUsed++;
+			bvhNode[leftChildIdx].firstPrimIdx = node.firstPrimIdx;
+			bvhNode[leftChildIdx].primCount = leftCount;
+			bvhNode[rightChildIdx].firstPrimIdx = i;
+			bvhNode[rightChildIdx].primCount = node.primCount - leftCount;
+			node.leftNode = leftChildIdx;
+			node.primCount = 0;
+			UpdateNodeBounds(leftChildIdx);
+			UpdateNodeBounds(rightChildIdx);
+			Subdivide(leftChildIdx, depth + 1);
+			Subdivide(rightChildIdx, depth + 1);
+		}
+
+		inline void IntersectTri(uint tri, Ray& ray) const
+		{
+			const float3 v0 = Vertex(tri, 0);
+			const float3 v0v1 = Vertex(tri, 1) - v0;
+			const float3 v0v2 = Vertex(tri, 2) - v0;
+			const float3 pvec = cross(ray.D, v0v2);
+			const float det = dot(v0v1, pvec);
+			if (fabs(det) < 1e-12f) return;
+			const float invDet = 1 / det;
+			const float3 tvec = ray.O - v0;
+			const float u = dot(tvec, pvec) * invDet;
+			if (u < 0 || u > 1) return;
+			const float3 qvec = cross(tvec, v0v1);
+			const float v = dot(ray.D, qvec) * invDet;
+			if (v < 0 || u + v > 1) return;
+			const float t = dot(v0v2, qvec) * invDet;
+			if (t > FLT_EPSILON && t < ray.t) ray.t = t, ray.primIdx = tri, ray.u = u, ray.v = v;
+		}
+
+		static inline float IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax)
+		{
+			float tx1 = (bmin.x - ray.O.x) * ray.rD.x, tx2 = (bmax.x - ray.O.x) * ray.rD.x;
+			float tmin = min(tx1, tx2), tmax = max(tx1, tx2);
+			float ty1 = (bmin.y - ray.O.y) * ray.rD.y, ty2 = (bmax.y - ray.O.y) * ray.rD.y;
+			tmin = max(tmin, min(ty1, ty2)), tmax = min(tmax, max(ty1, ty2));
+			float tz1 = (bmin.z - ray.O.z) * ray.rD.z, tz2 = (bmax.z - ray.O.z) * ray.rD.z;
+			tmin = max(tmin, min(tz1, tz2)), tmax = min(tmax, max(tz1, tz2));
+			if (tmax >= tmin && tmin < ray.t && tmax > 0) return tmin; else return 1e30f;
+		}
+
+		// owned storage when parsed from OBJ; empty when mapped from a binary file
+		vector<float3> vertexData;
+		vector<uint> indexData, triIdxData;
+		vector<BVHNode> nodeData;
+		vector<float3> centroids;
+		void* mapping = 0;
+	};
+
+}
@@ -0,0 +1,252 @@
+#pragma once
+
+// path guiding: a learned distribution of incident radiance, sampled next to the
+// BSDF. Practical Path Guiding (Müller et al. 2017): a binary tree over space
+// (S-tree), with a quadtree over directions (D-tree) in every leaf
+#define GUIDING_MAX_VERTICES	16
+#define GUIDING_MAX_DEPTH		20	// of a D-tree
+#define GUIDING_NORMAL_CLUSTERS	6	// D-trees per S-tree leaf: one per dominant axis and sign of the normal
+
+namespace Tmpl8 {
+	struct DTreeNode
+	{
+		AtomicFloat energy[4];	// per quadrant; x in bit 0, y in bit 1
+		uint child[4] = {};		// 0: the quadrant is a leaf
+	};
+
+	// directional distribution: a quadtree over the square of (cos theta, phi),
+	// which maps to the sphere preserving area. While training, energy is only
+	// added to leaf quadrants; Build sums it up the tree
+	class DTree
+	{
+	public:
+		DTree() : nodes(1) {}
+
+		static float2 ToSquare(const float3 d)
+		{
+			float phi = atan2f(d.y, d.x) * (0.5f * INVPI);
+			return float2(clamp((d.z + 1) * 0.5f, 0.0f, 0.99999994f), min(phi < 0 ? phi + 1 : phi, 0.99999994f));
+		}
+
+		static float3 FromSquare(const float2 p)
+		{
+			const float cosTheta = 2 * p.x - 1, sinTheta = sqrtf(max(0.0f, 1 - cosTheta * cosTheta)), phi = 2 * PI * p.y;
+			return float3(sinTheta * cosf(phi), sinTheta * sinf(phi), cosTheta);
+		}
+
+		static int Quadrant(float2& p)
+		{
+			// returns the quadrant of p, and p in the quadrant's own coordinates
+			const int qx = p.x >= 0.5f, qy = p.y >= 0.5f;
+			p.x = p.x * 2 - qx, p.y = p.y * 2 - qy;
+			return qx + 2 * qy;
+		}
+
+		float Sum(const uint node) const
+		{
+			const DTreeNode& n = nodes[node];
+			return n.energy[0].Load() + n.energy[1].Load() + n.energy[2].Load() + n.energy[3].Load();
+		}
+
+		void Record(const float3 dir, const float value)
+		{
+			float2 p = ToSquare(dir);
+			for (uint node = 0;; )
+			{
+				const int q = Quadrant(p);
+				if (!nodes[node].child[q]) { nodes[node].energy[q].Add(value); break; }
+				node = nodes[node].child[q];
+			}
+			samples.Add(1);
+		}
+
+		float Pdf(const float3 dir) const
+		{
+			if (total <= 0) return 0.25f * INVPI;
+			float2 p = ToSquare(dir);
+			float pdf = 0.25f * INVPI;
+			for (uint node = 0;; )
+			{
+				const int q = Quadrant(p);
+				pdf *= 4 * nodes[node].energy[q].Load() / Sum(node);
+				if (!nodes[node].child[q] || pdf == 0) return pdf;
+				node = nodes[node].child[q];
+			}
+		}
+
+		float3 Sample(float r0, float r1) const
+		{
+			// pick the x half, then the y half within it, reusing the random numbers;
+			// inside a leaf quadrant the direction is uniform
+			if (total <= 0) return FromSquare(float2(r0, r1));
+			float2 origin(0);
+			float size = 1;
+			for (uint node = 0;; )
+			{
+				const DTreeNode& n = nodes[node];
+				const float e[4] = { n.energy[0].Load(), n.energy[1].Load(), n.energy[2].Load(), n.energy[3].Load() };
+				const float left = e[0] + e[2], right = e[1] + e[3];
+				int qx = 0, qy = 0;
+				float pl = left / (left + right);
+				if (r0 < pl) r0 = r0 / pl;
+				else r0 = min((r0 - pl) / (1 - pl), 0.99999994f), qx = 1;
+				float pb = e[qx] / (e[qx] + e[qx + 2]);
+				if (r1 < pb) r1 = r1 / pb;
+				else r1 = min((r1 - pb) / (1 - pb), 0.99999994f), qy = 1;
+				size *= 0.5f, origin += float2((float)qx, (float)qy) * size;
+				const int q = qx + 2 * qy;
+				if (!n.child[q]) return FromSquare(origin + float2(r0, r1) * size);
+				node = n.child[q];
+			}
+		}
+
+		// after training: internal quadrants take the energy of their children
+		void Build()
+		{
+			for (int node = (int)nodes.size() - 1; node >= 0; node--)
+				for (int q = 0; q < 4; q++) if (nodes[node].child[q]) nodes[node].energy[q] = Sum(nodes[node].child[q]);
+			total = Sum(0);
+		}
+
+		// a new, empty tree for the next training iteration: quadrants holding more
+		// than threshold of the total energy are subdivided, the rest are merged
+		DTree Refined(const float threshold) const
+		{
+			DTree tree;
+			if (total <= 0) return tree;
+			struct Entry { uint node, srcNode; int depth; };
+			vector<Entry> stack = { { 0, 0, 1 } };
+			while (!stack.empty())
+			{
+				const Entry entry = stack.back();
+				stack.pop_back();
+				for (int q = 0; q < 4; q++)
+				{
+					const float energy = nodes[entry.srcNode].energy[q].Load();
+					if (entry.depth >= GUIDING_MAX_DEPTH || energy <= threshold * total) continue;
+					const uint child = (uint)tree.nodes.size(), srcChild = nodes[entry.srcNode].child[q];
+					tree.nodes.push_back(DTreeNode{});
+					tree.nodes[entry.node].child[q] = child;
+					if (srcChild) stack.push_back({ child, srcChild, entry.depth + 1 });
+					else tree.SplitLeaf(child, energy, threshold * total, entry.depth + 1);
+				}
+			}
+			return tree;
+		}
+
+		void SplitLeaf(const uint node, const float energy, const float threshold, const int depth)
+		{
+			// a leaf quadrant above the threshold: subdivide it as if its energy were uniform
+			const float quarter = energy * 0.25f;
+			if (quarter <= threshold || depth >= GUIDING_MAX_DEPTH) return;
+			for (int q = 0; q < 4; q++)
+			{
+				const uint child = (uint)nodes.size();
+				nodes.push_back(DTreeNode{});
+				nodes[node].child[q] = child;
+				SplitLeaf(child, quarter, threshold, depth + 1);
+			}
+		}
+
+		vector<DTreeNode> nodes;
+		AtomicFloat samples;
+		float total = 0;
+	};
+
+	struct STreeNode
+	{
+		float Samples() const
+		{
+			float sum = 0;
+			for (const DTree& tree : training) sum += tree.samples.Load();
+			return sum;
+		}
+		uint child = 0;	// children child and child + 1; 0 for a leaf
+		int axis = 0;
+		// points facing different ways see different hemispheres: on a curved
+		// surface, one tree per normal cluster keeps them apart
+		DTree sampling[GUIDING_NORMAL_CLUSTERS], training[GUIDING_NORMAL_CLUSTERS];
+	};
+
+	// the S-tree and its training schedule: iteration k lasts 2^k frames, during
+	// which paths record into the training D-trees while sampling from the
+	// result of the previous iteration
+	class PathGuide
+	{
+	public:
+		void Init(const float3 bmin, const float3 bmax)
+		{
+			// a cube, so that halving along alternating axes keeps cells cubic
+			const float3 e = bmax - bmin;
+			const float size = max(e.x, max(e.y, e.z)) * 1.001f;
+			origin = (bmin + bmax) * 0.5f - size * 0.5f, extent = size;
+			nodes.clear(), nodes.resize(1);
+			iteration = 0, frame = 0;
+		}
+
+		uint Leaf(const float3 P) const
+		{
+			float3 p = (P - origin) * (1 / extent);
+			p = clamp(p, 0.0f, 0.99999994f);
+			uint node = 0;
+			while (nodes[node].child)
+			{
+				const int axis = nodes[node].axis, side = p[axis] >= 0.5f;
+				p[axis] = p[axis] * 2 - side;
+				node = nodes[node].child + side;
+			}
+			return node;
+		}
+
+		static int Cluster(const float3 N)
+		{
+			const float3 a = fabs(N);
+			const int axis = a.x > a.y && a.x > a.z ? 0 : a.y > a.z ? 1 : 2;
+			return axis * 2 + ((axis == 0 ? N.x : axis == 1 ? N.y : N.z) < 0);
+		}
+
+		const DTree& Sampling(const float3 P, const float3 N) const { return nodes[Leaf(P)].sampling[Cluster(N)]; }
+		void Record(const float3 P, const float3 N, const float3 dir, const float value) { nodes[Leaf(P)].training[Cluster(N)].Record(dir, value); }
+
+		// once per frame, after all paths were traced
+		void Update()
+		{
+			if (++frame < (1 << iteration)) return;
+			// spatial refinement: a leaf splits while it received more than
+			// spatialThreshold * sqrt(2^k) samples, assumed to halve per split
+			const float limit = spatialThreshold * sqrtf((float)(1 << iteration));
+			for (uint i = 0; i < nodes.size(); i++)
+			{
+				if (nodes[i].child || nodes[i].Samples() <= limit || nodes.size() > maxSpatialNodes) continue;
+				for (DTree& tree : nodes[i].training) tree.samples = tree.samples.Load() * 0.5f;
+				const uint child = (uint)nodes.size();
+				nodes[i].child = child;
+				STreeNode node = nodes[i];
+				node.child = 0, node.axis = (node.axis + 1) % 3;
+				for (int c = 0; c < GUIDING_NORMAL_CLUSTERS; c++) nodes[i].sampling[c] = nodes[i].training[c] = DTree();
+				nodes.push_back(node), nodes.push_back(node);
+			}
+			#pragma omp parallel for schedule(dynamic)
+			for (int i = 0; i < (int)nodes.size(); i++)
+			{
+				STreeNode& node = nodes[i];
+				if (node.child) continue;
+				for (int c = 0; c < GUIDING_NORMAL_CLUSTERS; c++)
+				{
+					node.training[c].Build();
+					node.sampling[c] = node.training[c];
+					node.training[c] = node.sampling[c].Refined(directionalThreshold);
+				}
+			}
+			iteration = min(iteration + 1, 30), frame = 0;
+		}
+
+		vector<STreeNode> nodes;
+		float3 origin;
+		float extent = 1;
+		int iteration = 0, frame = 0;
+		float spatialThreshold = 12000;
+		float directionalThreshold = 0.01f;
+		uint maxSpatialNodes = 1 << 16;
+	};
+}
@@ -4,107 +4,209 @@ class PathTraceModule
 public:
 	void Init(Scene& scene)
 	{
-		scene = scene;
+		this->scene = &scene;
+		const BVHNode& root = scene.bvhNode[scene.rootNodeIdx];
+		guide.Init(root.aabbMin, root.aabbMax);
+		radianceCache.Init();
+		photonMap.Init();
 		isInitialized = true;
 	}
 
-	float3 Trace(Ray& ray)
+	float3 Trace(Ray& ray, const Sampler& sampler)
 	{
-		float3 result;
+		// the primary hit is the same for every sample: find and shade it once
+		scene->FindNearest(ray);
+		if (ray.objIdx == -1) return 0;
+		ShadingData hit;
+		scene->GetShadingData(ray, hit);
+		return Trace(ray, hit, sampler);
+	}
+
+	float3 Trace(const Ray& ray, const ShadingData& hit, const Sampler& sampler, const float3* primaryDirect = 0)
+	{
+		// primaryDirect: direct light at a diffuse primary hit, estimated by the caller
+		float3 result(0);
 		for (int i = 0; i < sampleCount; i++)
 		{
-			result += Sample(ray, 1);
+			// each path is its own sample index, so the paths of one pixel stratify
+			Sampler pathSampler = sampler;
+			pathSampler.index = sampler.index * sampleCount + i;
+			result += Sample(ray, hit, pathSampler, primaryDirect);
 		}
 
-		result *= 2 * PI / sampleCount;
+		result *= 1.0f / sampleCount;
 		return result;
 	}
 
-	float3 Sample(Ray& ray, int depth)
+	float3 Sample(Ray ray, ShadingData hit, const Sampler& sampler, const float3* primaryDirect = 0)
 	{
-		if (depth > depthLimit) return 0;
-		scene.FindNearest(ray);
-		if (ray.objIdx == -1) return 0; // or a fancy sky color
-		float3 I = ray.O + ray.t * ray.D;
-		float3 N = scene.GetNormal(ray.objIdx, I, ray.D);
-		Material material = scene.GetMaterial(ray.objIdx);
-
-		if (material.isLight) return scene.GetLightColor();
-
-		float3 albedo = scene.GetAlbedo(ray.objIdx, I); // very bad
-
-		//refraction of glass: 1.52 
-		float n1 = 1;
-		float n2 = 1.52f;
-		float n1DividedByn2 = n1 / n2;
-		float cosI = dot(N, -ray.D);
-		float k = 1 - (((n1 / n2) * (n1 / n2)) * (1 - (cosI * cosI)));
-
-		// glass
-		if (material.isGlass && !(k < 0))
+		// iterative path, starting at the primary hit: radiance is gathered
+		// along the way, weighted by the throughput of all previous vertices
+		float3 radiance(0), throughput(1);
+		float bsdfPdf = 0; // density of the last diffuse bounce; 0 after camera rays and specular bounces
+		float3 lastI, lastN; // the last diffuse vertex, for the light selection pmf
+		bool directGiven = false; // the last vertex was the primary hit, lit through primaryDirect
+		// diffuse vertices for guide training: the radiance found after a vertex,
+		// divided by the throughput up to it, is the radiance arriving along wi
+		struct GuidingVertex { float3 I, N, wi, throughput, radiance; float cosWi, pdf; };
+		GuidingVertex vertices[GUIDING_MAX_VERTICES];
+		int vertexCount = 0;
+		// radiance cache: a few paths are traced in full and train the cache at
+		// their diffuse vertices; the others end in it after the first diffuse bounce
+		struct CacheVertex { float3 I, N, albedo, throughput, radiance; };
+		CacheVertex cacheVertices[RADIANCE_CACHE_MAX_VERTICES];
+		int cacheVertexCount = 0, diffuseVertices = 0;
+		const bool cacheTraining = useRadianceCache && sampler.Stream(STREAM_RADIANCE_CACHE).NextFloat() < cacheTrainingFraction;
+		for (int depth = 1;; )
 		{
-			float ThetaI = acos(cosI);
-			float sinI = sin(ThetaI);
+			const Material& material = *hit.material;
 
-			float cosT = sqrt(1 - (n1DividedByn2 * sinI));
-			float Rs = ((n1 * cosI) - (n2 * cosT)) / ((n1 * cosI) + (n2 * cosT));
-			float Rp = ((n1 * cosI) - (n2 * cosT)) / ((n1 * cosI) + (n2 * cosT));
-
-			float Fr = ((Rs * Rs) + (Rp * Rp)) / 2;
-			//float Ft = 1 - Fr;
+			if (material.isLight)
+			{
+				// the caller's direct light covers the registered lights only
+				if (directGiven && scene->objectLight[ray.objIdx] >= 0) break;
+				// light seen through glass or a mirror from a diffuse vertex: the photons have it
+				if (usePhotonMap && diffuseVertices > 0 && bsdfPdf == 0) break;
+				float weight = !useNEE || bsdfPdf == 0 ? 1 : PowerHeuristic(bsdfPdf, scene->LightPdf(ray, hit.N, lastI, lastN));
+				radiance += throughput * material.color * weight;
+				break;
+			}
+			directGiven = false;
 
-			float p = Rand(1);
+			// fixed dimensions per vertex: 0 glass, 1-2 BSDF, 3-5 light, 6 russian roulette, 7 guiding
+			const uint dim = SAMPLER_CAMERA_DIMS + (depth - 1) * SAMPLER_BOUNCE_DIMS;
+			const float3 I = hit.I, N = hit.N, albedo = hit.albedo;
 
-			if(p > Fr)
+			float3 direction;
+			if (BSDFUtils::SampleSpecular(material, N, ray.D, sampler.Get(dim), direction))
 			{
-				float3 reflectDirection = reflect(ray.D, N);
-				return albedo * Sample(Ray(I + reflectDirection * 0.001f, reflectDirection), depth + 1);
+				// glass or mirror
+				throughput *= albedo;
+				ray = Ray(I + direction * 0.001f, direction);
+				bsdfPdf = 0;
 			}
 			else
 			{
-				float3 refractDirection = (n1DividedByn2 * ray.D) + (N * ((n1DividedByn2 * cosI) - sqrt(k)));
-				return albedo * Sample(Ray(I + (refractDirection * 0.001f), refractDirection), depth + 1);
+				// diffuse
+				const float3 wo = -ray.D;
+				// caustics come from the photons at every diffuse vertex, also one that ends
+				// in the cache: cells hold the light of the paths beyond their vertex
+				if (usePhotonMap) radiance += throughput * albedo * INVPI * photonMap.Irradiance(I, N);
+				if (useRadianceCache && !cacheTraining && diffuseVertices > 0 && length(I - lastI) >= radianceCache.CellSize(I))
+				{
+					// the cache stores radiance divided by the albedo, so that textures stay sharp;
+					// a short last segment is traced on, as the cell would blur a corner
+					float3 cached;
+					if (radianceCache.Lookup(I, N, cached)) { radiance += throughput * albedo * cached; break; }
+				}
+				// a black channel of the albedo would record 0 for the whole cell
+				if (cacheTraining && min(albedo.x, min(albedo.y, albedo.z)) > 0 && cacheVertexCount < RADIANCE_CACHE_MAX_VERTICES) cacheVertices[cacheVertexCount++] = { I, N, albedo, throughput, radiance };
+				diffuseVertices++;
+				// a cell that has not seen any light yet is left to the BSDF
+				const DTree* dtree = useGuiding ? &guide.Sampling(I, N) : 0;
+				if (dtree && dtree->total <= 0) dtree = 0;
+				// the last vertex skips light sampling: a bounce from it would be cut off as well
+				if (depth == 1 && primaryDirect) radiance += *primaryDirect, directGiven = true;
+				else if (useNEE && depth < depthLimit) radiance += throughput * SampleLight(I, N, wo, material, albedo, sampler, dim + 3, dtree);
+
+				// one-sample MIS: the direction comes from the BSDF or from the guide,
+				// and is weighted by the density of the mixture
+				BSDFSample bsdf;
+				if (dtree && sampler.Get(dim + 7) >= bsdfSamplingFraction)
+				{
+					bsdf.wi = dtree->Sample(sampler.Get(dim + 1), sampler.Get(dim + 2));
+					bsdf.f = BSDFUtils::Eval(material, N, wo, bsdf.wi, albedo);
+				}
+				else bsdf = BSDFUtils::Sample(material, N, wo, albedo, sampler.Get(dim + 1), sampler.Get(dim + 2));
+				bsdf.pdf = ScatterPdf(material, N, wo, bsdf.wi, dtree);
+				const float cosWi = dot(N, bsdf.wi);
+				if (bsdf.pdf <= 0 || cosWi <= 0) break;
+				throughput *= bsdf.f * (cosWi / bsdf.pdf);
+				ray = Ray(I + bsdf.wi * 0.001f, bsdf.wi);
+				bsdfPdf = bsdf.pdf, lastI = I, lastN = N;
+				if (useGuiding && vertexCount < GUIDING_MAX_VERTICES) vertices[vertexCount++] = { I, N, bsdf.wi, throughput, radiance, cosWi, bsdf.pdf };
+			}
+
+			// russian roulette: survivors carry the energy of the terminated paths
+			if (depth >= russianRouletteDepth)
+			{
+				float survival = min(0.95f, max(throughput.x, max(throughput.y, throughput.z)));
+				if (sampler.Get(dim + 6) >= survival) break;
+				throughput *= 1 / survival;
 			}
-		}
 
-		if (material.isMirror || (material.isGlass && k < 0))
+			if (++depth > depthLimit) break;
+			scene->FindNearest(ray);
+			if (ray.objIdx == -1) break; // or a fancy sky color
+			scene->GetShadingData(ray, hit);
+		}
+		for (int i = 0; i < vertexCount; i++)
 		{
-			float3 reflectDirection = reflect(ray.D, N);
-			return albedo * Sample(Ray(I + N * FLT_EPSILON, reflectDirection), depth + 1);
+			const GuidingVertex& v = vertices[i];
+			const float3 found = radiance - v.radiance, t = v.throughput;
+			const float3 Li(t.x > 0 ? found.x / t.x : 0, t.y > 0 ? found.y / t.y : 0, t.z > 0 ? found.z / t.z : 0);
+			guide.Record(v.I, v.N, v.wi, dot(Li, float3(0.2126f, 0.7152f, 0.0722f)) * v.cosWi / v.pdf);
 		}
-
-		float3 R = DiffuseReflection(N);
-		Ray rayToHemisphere = Ray(I + R * FLT_EPSILON, R);
-
-		float3 BRDF = albedo * INVPI;
-		float3 Ei = Sample(rayToHemisphere, depth + 1) * dot(N, R);
-
-		return PI * 2.0f * BRDF * Ei;
+		for (int i = 0; i < cacheVertexCount; i++)
+		{
+			const CacheVertex& v = cacheVertices[i];
+			const float3 found = radiance - v.radiance, t = v.throughput * v.albedo;
+			radianceCache.Record(v.I, v.N, float3(t.x > 0 ? found.x / t.x : 0, t.y > 0 ? found.y / t.y : 0, t.z > 0 ? found.z / t.z : 0));
+		}
+		return radiance;
 	}
 
-	float3 DiffuseReflection(float3 N)
+	float ScatterPdf(const Material& material, const float3 N, const float3 wo, const float3 wi, const DTree* dtree) const
 	{
-		// reference https://math.stackexchange.com/questions/1585975/how-to-generate-random-points-on-a-sphere
-		// I am still figuring it out
-		float u1 = Rand(1.f);
-		float u2 = Rand(1.f);
-
-		float theta1 = acosf(2 * u1 - 1) - (PI / 2);
-		float theta2 = 2 * PI * u2;
-
-		float3 direction = normalize(float3(
-			cos(theta1) * cos(theta2),
-			cos(theta1) * sin(theta2),
-			sin(theta1)
-		));
+		const float pdf = BSDFUtils::Pdf(material, N, wo, wi);
+		return dtree ? bsdfSamplingFraction * pdf + (1 - bsdfSamplingFraction) * dtree->Pdf(wi) : pdf;
+	}
 
-		if (dot(direction, N) < 0) return direction * -1;
+	float3 SampleLight(const float3 I, const float3 N, const float3 wo, const Material& material, const float3 albedo, const Sampler& sampler, const uint dim, const DTree* dtree = 0)
+	{
+		// next event estimation: pick one light, then one shadow ray to a random point on it
+		float pmf;
+		int light = scene->PickLight(I, N, sampler.Get(dim), pmf);
+		if (light < 0) return 0;
+		float3 P, lightN;
+		scene->SamplePointOnLight(light, sampler.Get(dim + 1), sampler.Get(dim + 2), P, lightN);
+		float3 L = P - I;
+		float dist2 = dot(L, L), dist = sqrtf(dist2);
+		L /= dist;
+		float cosI = dot(N, L);
+		float cosO = fabs(dot(lightN, L));
+		if (cosI <= 0 || cosO <= 0) return 0;
+		Ray shadowRay(I + L * 0.001f, L, dist - 0.002f, VIS_SHADOW);
+		if (scene->IsOccluded(shadowRay)) return 0;
+		float lightPdf = pmf * dist2 / (cosO * scene->lights[light].area);
+		float bsdfPdf = ScatterPdf(material, N, wo, L, dtree);
+		float3 f = BSDFUtils::Eval(material, N, wo, L, albedo);
+		return scene->lights[light].emission * f * (cosI * PowerHeuristic(lightPdf, bsdfPdf) / lightPdf);
+	}
 
-		return direction;
+	static float PowerHeuristic(const float pdfA, const float pdfB)
+	{
+		return (pdfA * pdfA) / (pdfA * pdfA + pdfB * pdfB);
 	}
 
-	int depthLimit = 5;
+	int depthLimit = 16;
+	int russianRouletteDepth = 3; // first vertex at which paths may be terminated early
 	int sampleCount = 5;
+	bool useNEE = true; // light sampling with MIS; off: light is only found by bouncing into it
+	// path guiding: diffuse bounces sample the learned incident radiance with
+	// probability 1 - bsdfSamplingFraction; the renderer calls guide.Update per frame
+	PathGuide guide;
+	bool useGuiding = false;
+	float bsdfSamplingFraction = 0.9f;
+	// radiance cache: paths end in it after the first diffuse bounce, except for a
+	// fraction that trains it; the renderer calls radianceCache.Update per frame
+	RadianceCache radianceCache;
+	bool useRadianceCache = false;
+	float cacheTrainingFraction = 0.1f;
+	// caustics: at diffuse vertices, light that arrives through glass or mirrors
+	// comes from the photon map; the renderer emits a pass per frame
+	PhotonMap photonMap;
+	bool usePhotonMap = false;
 	bool isInitialized = false;
-	Scene scene;
+	Scene* scene = 0;
 };
\ No newline at end of file
@@ -0,0 +1,139 @@
+#pragma once
+
+// caustics by progressive photon mapping: photons leave the lights, and those
+// that reach a diffuse surface through glass or mirrors are stored in a hashed
+// grid. Every pass shrinks the gather radius (Knaus and Zwicker, Progressive
+// Photon Mapping: A Probabilistic Approach, 2011), so the mean over passes converges
+#define PHOTON_GRID_SIZE	(1 << 18)	// hash buckets; a power of two
+#define PHOTON_MAX_BOUNCES	8
+
+namespace Tmpl8 {
+	struct Photon
+	{
+		float3 P, D;	// position, and the direction it arrived from the light
+		float3 power;
+	};
+
+	class PhotonMap
+	{
+	public:
+		void Init() { cellStart.assign(PHOTON_GRID_SIZE + 1, 0); }
+
+		// one pass: emit, trace and store; pass 0 starts over at initialRadius
+		void Emit(Scene& scene, const uint pass)
+		{
+			radius2 = pass == 0 ? initialRadius * initialRadius : radius2 * (pass + alpha) / (pass + 1);
+			cellSize = 2 * sqrtf(radius2);
+			photons.clear();
+			if (scene.lights.empty()) return;
+			#pragma omp parallel
+			{
+				vector<Photon> stored;
+				#pragma omp for schedule(dynamic, 256)
+				for (int i = 0; i < photonCount; i++)
+				{
+					// one generator per photon: the same photons on any number of threads
+					PCG32 rng(((uint64_t)pass << 32) | (uint)i, 0x9e3779b9);
+					TracePhoton(scene, rng, stored);
+				}
+				#pragma omp critical
+				photons.insert(photons.end(), stored.begin(), stored.end());
+			}
+			Build();
+		}
+
+		void TracePhoton(Scene& scene, PCG32& rng, vector<Photon>& stored) const
+		{
+			// lights are picked by power and emit on both sides, cosine-weighted
+			const int light = scene.lightTable.Sample(rng.NextFloat());
+			float3 P, N;
+			scene.SamplePointOnLight(light, rng.NextFloat(), rng.NextFloat(), P, N);
+			if (rng.NextFloat() < 0.5f) N = -N;
+			const float3 D = BSDFUtils::SampleCosineHemisphere(N, rng.NextFloat(), rng.NextFloat());
+			float3 power = scene.lights[light].emission * (2 * PI * scene.lights[light].area / scene.lightTable.pmf[light]);
+			Ray ray(P + D * 0.001f, D);
+			bool specular = false;
+			for (int bounce = 0; bounce < PHOTON_MAX_BOUNCES; bounce++)
+			{
+				scene.FindNearest(ray);
+				if (ray.objIdx == -1) return;
+				ShadingData hit;
+				scene.GetShadingData(ray, hit);
+				if (hit.material->isLight) return;
+				float3 direction;
+				if (!BSDFUtils::SampleSpecular(*hit.material, hit.N, ray.D, rng.NextFloat(), direction))
+				{
+					// only caustic paths are stored: direct light is left to light sampling
+					if (specular) stored.push_back({ hit.I, ray.D, power });
+					return;
+				}
+				power *= hit.albedo, specular = true;
+				ray = Ray(hit.I + direction * 0.001f, direction);
+			}
+		}
+
+		uint Cell(const int3 c) const { return SamplerUtils::Hash(SamplerUtils::HashCombine(SamplerUtils::HashCombine(SamplerUtils::Hash(c.x), c.y), c.z)) & (PHOTON_GRID_SIZE - 1); }
+		int3 CellCoord(const float3 P) const { return make_int3(floorf(P * (1 / cellSize))); }
+
+		void Build()
+		{
+			// counting sort by hash bucket, in parallel: count, prefix sum, scatter
+			const int count = (int)photons.size();
+			vector<uint> bucket(count);
+			std::fill(cellStart.begin(), cellStart.end(), 0);
+			#pragma omp parallel for schedule(static)
+			for (int i = 0; i < count; i++)
+			{
+				bucket[i] = Cell(CellCoord(photons[i].P));
+				#pragma omp atomic
+				cellStart[bucket[i] + 1]++;
+			}
+			for (int i = 0; i < PHOTON_GRID_SIZE; i++) cellStart[i + 1] += cellStart[i];
+			vector<uint> next(cellStart.begin(), cellStart.end() - 1);
+			sorted.resize(count);
+			#pragma omp parallel for schedule(static)
+			for (int i = 0; i < count; i++)
+			{
+				uint slot;
+				#pragma omp atomic capture
+				slot = next[bucket[i]]++;
+				sorted[slot] = photons[i];
+			}
+		}
+
+		// flux density arriving at a surface point, from the photons within the radius
+		float3 Irradiance(const float3 I, const float3 N) const
+		{
+			if (sorted.empty()) return 0;
+			// cells are twice the radius wide: the sphere fits in the two by two by two
+			// block that starts at its lower corner
+			const int3 c0 = CellCoord(I - sqrtf(radius2));
+			uint visited[8];
+			int visitedCount = 0;
+			float3 sum(0);
+			for (int z = 0; z < 2; z++) for (int y = 0; y < 2; y++) for (int x = 0; x < 2; x++)
+			{
+				// two cells may share a bucket
+				const uint cell = Cell(c0 + make_int3(x, y, z));
+				bool seen = false;
+				for (int i = 0; i < visitedCount; i++) seen |= visited[i] == cell;
+				if (seen) continue;
+				visited[visitedCount++] = cell;
+				for (uint i = cellStart[cell]; i < cellStart[cell + 1]; i++)
+				{
+					const Photon& photon = sorted[i];
+					const float3 d = photon.P - I;
+					if (dot(d, d) < radius2 && dot(photon.D, N) < 0) sum += photon.power;
+				}
+			}
+			return sum * (1 / (PI * radius2 * photonCount));
+		}
+
+		vector<Photon> photons, sorted;
+		vector<uint> cellStart;
+		int photonCount = 1 << 16;	// emitted per pass
+		float initialRadius = 0.1f;
+		float alpha = 0.7f;			// fraction of the photons kept per pass: lower shrinks faster
+		float radius2 = 0, cellSize = 1;
+	};
+}
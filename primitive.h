@@ -2,75 +2,29 @@
 namespace Tmpl8 {
 	struct Tri { float3 vertex0, vertex1, vertex2; float3 centroid; };
 
+	// precomputed world-to-triangle transform (Woop / Baldwin-Weber), 48 bytes:
+	// maps v0 to the origin, edge 1 to x, edge 2 to y and the face normal to z.
+	struct TriAccel { float4 row0, row1, row2; };
+
 	struct Primitive {
 	public:
 		int objIdx;
 		int matIdx;
-		int type; // 0 triangle, 1 shpere, 2 plane, 3 cube, 4 quad
+		int type; // 0 triangle, 1 shpere, 2 plane, 3 cube, 4 quad, 5 mesh
 		Tri tri;
 		mat4 T, invT;
+		Mesh* mesh = 0;
+		uint visibility = VIS_ALL; // ray classes that can hit this primitive
 	};
 
 	class PrimitiveUtils {
 	public:
-		static AABB GetBounds(Primitive& p)
-		{
-			switch (p.type)
-			{
-				case 0:
-				default:
-					return GetBoundsTriangle(p);
-				case 1:
-					return GetBoundsSphere(p);
-				case 2:
-					return GetBoundsPlane(p);
-				case 3:
-					return GetBoundsCube(p);
-				case 4:
-					return GetBoundsQuad(p);
-			}
-		}
-
-		static float3 GetNormal(Primitive& p, float3 I) 
-		{
-			switch (p.type)
-			{
-				case 0:
-				default:
-					return GetNormalTriangle(p);
-				case 1:
-					return GetNormalSphere(p, I);
-				case 2:
-					return GetNormalPlane(p);
-				case 3:
-					return GetNormalCube(p, I);
-				case 4:
-					return GetNormalQuad(p);
-			}
-		}
-
-		static void Intersect(Primitive& p, Ray& ray) 
-		{
-			switch (p.type)
-			{
-				case 0:
-				default:
-					IntersectTriangle(p, ray);
-					break;
-				case 1:
-					IntersectSphere(p, ray);
-					break;
-				case 2:
-					IntersectPlane(p, ray);
-					break;
-				case 3:
-					IntersectCube(p, ray);
-					break;
-				case 4:
-					IntersectQuad(p, ray);
-					break;
-			}
-		}
+		// runtime dispatch on p.type through PrimitiveTypes (defined below)
+		static AABB GetBounds(Primitive& p);
+		static float3 GetNormal(Primitive& p, float3 I, int primIdx = -1);
+		static void Intersect(Primitive& p, Ray& ray);
+		// the central switch that dispatched before the kernels; the benchmark baseline
+		static void IntersectSwitch(Primitive& p, Ray& ray);
 
 		static inline AABB GetBoundsTriangle(Primitive& p)
 		{
@@ -130,6 +84,122 @@ namespace Tmpl8 {
 			return aabb;
 		}
 
+		static TriAccel BuildTriAccel(Primitive& p)
+		{
+			Tri& tri = p.tri;
+			float3 v0 = TransformPosition(tri.vertex0, p.T);
+			float3 e1 = TransformPosition(tri.vertex1, p.T) - v0;
+			float3 e2 = TransformPosition(tri.vertex2, p.T) - v0;
+			float3 n = cross(e1, e2);
+			// columns: e1, e2, n, v0; the inverse takes world space to triangle space
+			mat4 M;
+			M(0, 0) = e1.x, M(0, 1) = e2.x, M(0, 2) = n.x, M(0, 3) = v0.x;
+			M(1, 0) = e1.y, M(1, 1) = e2.y, M(1, 2) = n.y, M(1, 3) = v0.y;
+			M(2, 0) = e1.z, M(2, 1) = e2.z, M(2, 2) = n.z, M(2, 3) = v0.z;
+			mat4 invM = M.Inverted();
+			TriAccel accel;
+			accel.row0 = float4(invM(0, 0), invM(0, 1), invM(0, 2), invM(0, 3));
+			accel.row1 = float4(invM(1, 0), invM(1, 1), invM(1, 2), invM(1, 3));
+			accel.row2 = float4(invM(2, 0), invM(2, 1), invM(2, 2), invM(2, 3));
+			return accel;
+		}
+
+		static inline void IntersectTriAccel(const TriAccel& accel, int objIdx, Ray& ray)
+		{
+			// ray in triangle space: the hit is where the transformed ray crosses z = 0
+			const float4& r0 = accel.row0, & r1 = accel.row1, & r2 = accel.row2;
+			float Oz = r2.w + r2.x * ray.O.x + r2.y * ray.O.y + r2.z * ray.O.z;
+			float Dz = r2.x * ray.D.x + r2.y * ray.D.y + r2.z * ray.D.z;
+			float t = -Oz / Dz;
+			if (!(t > FLT_EPSILON && t < ray.t)) return;
+
+			float u = r0.w + r0.x * ray.O.x + r0.y * ray.O.y + r0.z * ray.O.z
+				+ t * (r0.x * ray.D.x + r0.y * ray.D.y + r0.z * ray.D.z);
+			if (u < 0 || u > 1) return;
+
+			float v = r1.w + r1.x * ray.O.x + r1.y * ray.O.y + r1.z * ray.O.z
+				+ t * (r1.x * ray.D.x + r1.y * ray.D.y + r1.z * ray.D.z);
+			if (v < 0 || u + v > 1) return;
+
+			ray.t = t, ray.objIdx = objIdx;
+			ray.u = u, ray.v = v;
+		}
+
+		// lane mask for the first 'count' lanes of a bundle
+		// lanes that share a visibility class with the ray; empty lanes have none
+		static inline __m256 VisibleLanes8(__m256i visibility, uint rayMask)
+		{
+			__m256i hidden = _mm256_cmpeq_epi32(_mm256_and_si256(visibility, _mm256_set1_epi32(rayMask)), _mm256_setzero_si256());
+			return _mm256_castsi256_ps(_mm256_xor_si256(hidden, _mm256_set1_epi32(-1)));
+		}
+
+		// keep the nearest valid lane: horizontal min over t, then write the hit
+		static inline int NearestLane8(__m256 t8, __m256 mask, float& tmin)
+		{
+			t8 = _mm256_blendv_ps(_mm256_set1_ps(1e34f), t8, mask);
+			__m256 m = _mm256_min_ps(t8, _mm256_permute2f128_ps(t8, t8, 1));
+			m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+			m = _mm256_min_ps(m, _mm256_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+			tmin = _mm256_cvtss_f32(m);
+			int lanes = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(t8, m, _CMP_EQ_OQ), mask));
+			return _tzcnt_u32(lanes);
+		}
+
+		static inline void IntersectTriAccel8(const TriAccel8& b, Ray& ray)
+		{
+			const __m256 Ox = _mm256_set1_ps(ray.O.x), Oy = _mm256_set1_ps(ray.O.y), Oz = _mm256_set1_ps(ray.O.z);
+			const __m256 Dx = _mm256_set1_ps(ray.D.x), Dy = _mm256_set1_ps(ray.D.y), Dz = _mm256_set1_ps(ray.D.z);
+			// distance to the triangle plane (z = 0 in triangle space)
+			__m256 oz = _mm256_add_ps(b.r2w, _mm256_add_ps(_mm256_mul_ps(b.r2x, Ox), _mm256_add_ps(_mm256_mul_ps(b.r2y, Oy), _mm256_mul_ps(b.r2z, Oz))));
+			__m256 dz = _mm256_add_ps(_mm256_mul_ps(b.r2x, Dx), _mm256_add_ps(_mm256_mul_ps(b.r2y, Dy), _mm256_mul_ps(b.r2z, Dz)));
+			__m256 t = _mm256_div_ps(_mm256_sub_ps(_mm256_setzero_ps(), oz), dz);
+			__m256 mask = _mm256_and_ps(VisibleLanes8(b.visibility, ray.mask), _mm256_and_ps(
+				_mm256_cmp_ps(t, _mm256_set1_ps(FLT_EPSILON), _CMP_GT_OQ),
+				_mm256_cmp_ps(t, _mm256_set1_ps(ray.t), _CMP_LT_OQ)));
+			if (_mm256_movemask_ps(mask) == 0) return;
+			// barycentrics
+			__m256 ou = _mm256_add_ps(b.r0w, _mm256_add_ps(_mm256_mul_ps(b.r0x, Ox), _mm256_add_ps(_mm256_mul_ps(b.r0y, Oy), _mm256_mul_ps(b.r0z, Oz))));
+			__m256 du = _mm256_add_ps(_mm256_mul_ps(b.r0x, Dx), _mm256_add_ps(_mm256_mul_ps(b.r0y, Dy), _mm256_mul_ps(b.r0z, Dz)));
+			__m256 u = _mm256_add_ps(ou, _mm256_mul_ps(t, du));
+			__m256 ov = _mm256_add_ps(b.r1w, _mm256_add_ps(_mm256_mul_ps(b.r1x, Ox), _mm256_add_ps(_mm256_mul_ps(b.r1y, Oy), _mm256_mul_ps(b.r1z, Oz))));
+			__m256 dv = _mm256_add_ps(_mm256_mul_ps(b.r1x, Dx), _mm256_add_ps(_mm256_mul_ps(b.r1y, Dy), _mm256_mul_ps(b.r1z, Dz)));
+			__m256 v = _mm256_add_ps(ov, _mm256_mul_ps(t, dv));
+			mask = _mm256_and_ps(mask, _mm256_and_ps(
+				_mm256_and_ps(_mm256_cmp_ps(u, _mm256_setzero_ps(), _CMP_GE_OQ), _mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_GE_OQ)),
+				_mm256_cmp_ps(_mm256_add_ps(u, v), _mm256_set1_ps(1), _CMP_LE_OQ)));
+			if (_mm256_movemask_ps(mask) == 0) return;
+			float tmin;
+			int lane = NearestLane8(t, mask, tmin);
+			ray.t = tmin, ray.objIdx = b.objIdx[lane];
+			ray.u = ((float*)&u)[lane], ray.v = ((float*)&v)[lane];
+		}
+
+		static inline void IntersectSphere8(const Sphere8& b, Ray& ray)
+		{
+			__m256 ocx = _mm256_sub_ps(_mm256_set1_ps(ray.O.x), b.cx);
+			__m256 ocy = _mm256_sub_ps(_mm256_set1_ps(ray.O.y), b.cy);
+			__m256 ocz = _mm256_sub_ps(_mm256_set1_ps(ray.O.z), b.cz);
+			__m256 bb = _mm256_add_ps(_mm256_mul_ps(ocx, _mm256_set1_ps(ray.D.x)),
+				_mm256_add_ps(_mm256_mul_ps(ocy, _mm256_set1_ps(ray.D.y)), _mm256_mul_ps(ocz, _mm256_set1_ps(ray.D.z))));
+			__m256 c = _mm256_sub_ps(_mm256_add_ps(_mm256_mul_ps(ocx, ocx),
+				_mm256_add_ps(_mm256_mul_ps(ocy, ocy), _mm256_mul_ps(ocz, ocz))), b.r2);
+			__m256 d = _mm256_sub_ps(_mm256_mul_ps(bb, bb), c);
+			__m256 mask = _mm256_and_ps(VisibleLanes8(b.visibility, ray.mask), _mm256_cmp_ps(d, _mm256_setzero_ps(), _CMP_GT_OQ));
+			if (_mm256_movemask_ps(mask) == 0) return;
+			d = _mm256_sqrt_ps(d);
+			// near root, or the far root for rays that start inside the sphere
+			__m256 t0 = _mm256_sub_ps(_mm256_sub_ps(_mm256_setzero_ps(), bb), d);
+			__m256 t1 = _mm256_sub_ps(d, bb);
+			__m256 t = _mm256_blendv_ps(t1, t0, _mm256_cmp_ps(t0, _mm256_setzero_ps(), _CMP_GT_OQ));
+			mask = _mm256_and_ps(mask, _mm256_and_ps(
+				_mm256_cmp_ps(t, _mm256_setzero_ps(), _CMP_GT_OQ),
+				_mm256_cmp_ps(t, _mm256_set1_ps(ray.t), _CMP_LT_OQ)));
+			if (_mm256_movemask_ps(mask) == 0) return;
+			float tmin;
+			int lane = NearestLane8(t, mask, tmin);
+			ray.t = tmin, ray.objIdx = b.objIdx[lane];
+		}
+
 		static inline void IntersectTriangle(Primitive& p, Ray& ray)
 		{
 			Tri& tri = p.tri;
@@ -155,10 +225,10 @@ namespace Tmpl8 {
 			if (v < 0 || u + v > 1) return;
 
 			float t = dot(v0v2, qvec) * invDet;
-			if (t > FLT_EPSILON)
+			if (t > FLT_EPSILON && t < ray.t)
 			{
-				ray.t = min(ray.t, t);
-				ray.objIdx = p.objIdx;
+				ray.t = t, ray.objIdx = p.objIdx;
+				ray.u = u, ray.v = v;
 			}
 		}
 
@@ -246,7 +316,7 @@ namespace Tmpl8 {
 			float3 v0v1 = tri.vertex1 - tri.vertex0;  //edge 0 
 			float3 v0v2 = tri.vertex2 - tri.vertex0;  //edge 1 
 			float3 N = cross(v0v1, v0v2);  //this is the triangle's normal 
-			return normalize(N);
+			return normalize(TransformVector(N, p.T));
 		}
 
 		static inline float3 GetNormalSphere(Primitive& p, float3 I)
@@ -286,6 +356,149 @@ namespace Tmpl8 {
 		}
 	};
 
+	// -----------------------------------------------------------
+	// Per-type kernels
+	// Each primitive type is a kernel with a compile-time type id.
+	// To add a primitive type, write a kernel and append it to
+	// PrimitiveTypes; nothing else dispatches on p.type.
+	// -----------------------------------------------------------
+	struct TriangleKernel
+	{
+		static constexpr int type = 0;
+		static AABB GetBounds(Primitive& p) { return PrimitiveUtils::GetBoundsTriangle(p); }
+		static float3 GetNormal(Primitive& p, float3 I, int primIdx) { return PrimitiveUtils::GetNormalTriangle(p); }
+		static void Intersect(Primitive& p, Ray& ray) { PrimitiveUtils::IntersectTriangle(p, ray); }
+		static float2 GetUV(Primitive& p, float3 I, const Ray& ray) { return float2(ray.u, ray.v); }
+	};
+
+	struct SphereKernel
+	{
+		static constexpr int type = 1;
+		static AABB GetBounds(Primitive& p) { return PrimitiveUtils::GetBoundsSphere(p); }
+		static float3 GetNormal(Primitive& p, float3 I, int primIdx) { return PrimitiveUtils::GetNormalSphere(p, I); }
+		static void Intersect(Primitive& p, Ray& ray) { PrimitiveUtils::IntersectSphere(p, ray); }
+		static float2 GetUV(Primitive& p, float3 I, const Ray& ray)
+		{
+			float3 d = TransformVector(I - TransformPosition(float3(0), p.T), p.invT) * p.tri.vertex0.z;
+			return float2(0.5f + atan2f(d.z, d.x) * INV2PI, acosf(clamp(d.y, -1.0f, 1.0f)) * INVPI);
+		}
+	};
+
+	struct PlaneKernel
+	{
+		static constexpr int type = 2;
+		static AABB GetBounds(Primitive& p) { return PrimitiveUtils::GetBoundsPlane(p); }
+		static float3 GetNormal(Primitive& p, float3 I, int primIdx) { return PrimitiveUtils::GetNormalPlane(p); }
+		static void Intersect(Primitive& p, Ray& ray) { PrimitiveUtils::IntersectPlane(p, ray); }
+		static float2 GetUV(Primitive& p, float3 I, const Ray& ray) { return float2(0); }
+	};
+
+	struct CubeKernel
+	{
+		static constexpr int type = 3;
+		static AABB GetBounds(Primitive& p) { return PrimitiveUtils::GetBoundsCube(p); }
+		static float3 GetNormal(Primitive& p, float3 I, int primIdx) { return PrimitiveUtils::GetNormalCube(p, I); }
+		static void Intersect(Primitive& p, Ray& ray) { PrimitiveUtils::IntersectCube(p, ray); }
+		static float2 GetUV(Primitive& p, float3 I, const Ray& ray) { return float2(0); }
+	};
+
+	struct QuadKernel
+	{
+		static constexpr int type = 4;
+		static AABB GetBounds(Primitive& p) { return PrimitiveUtils::GetBoundsQuad(p); }
+		static float3 GetNormal(Primitive& p, float3 I, int primIdx) { return PrimitiveUtils::GetNormalQuad(p); }
+		static void Intersect(Primitive& p, Ray& ray) { PrimitiveUtils::IntersectQuad(p, ray); }
+		static float2 GetUV(Primitive& p, float3 I, const Ray& ray)
+		{
+			float3 objI = TransformPosition(I, p.invT);
+			float invSize = 0.5f / p.tri.vertex0.x;
+			return float2(objI.x * invSize + 0.5f, objI.z * invSize + 0.5f);
+		}
+	};
+
+	struct MeshKernel
+	{
+		static constexpr int type = 5;
+		static AABB GetBounds(Primitive& p)
+		{
+			AABB aabb;
+			const AABB& b = p.mesh->bounds;
+			for (int i = 0; i < 8; i++)
+				aabb.grow(TransformPosition(float3(i & 1 ? b.bmax.x : b.bmin.x, i & 2 ? b.bmax.y : b.bmin.y, i & 4 ? b.bmax.z : b.bmin.z), p.T));
+			return aabb;
+		}
+		static float3 GetNormal(Primitive& p, float3 I, int primIdx) { return TransformVector(p.mesh->GetNormal(primIdx), p.T); }
+		static void Intersect(Primitive& p, Ray& ray)
+		{
+			// the mesh BVH lives in object space; the transform has no scale, so t carries over
+			Ray local(TransformPosition(ray.O, p.invT), TransformVector(ray.D, p.invT), ray.t);
+			p.mesh->Intersect(local);
+			if (local.primIdx >= 0)
+				ray.t = local.t, ray.objIdx = p.objIdx, ray.primIdx = local.primIdx, ray.u = local.u, ray.v = local.v;
+		}
+		static float2 GetUV(Primitive& p, float3 I, const Ray& ray) { return float2(ray.u, ray.v); }
+	};
+
+	template <class... Kernels> struct PrimitiveTypeList
+	{
+		static constexpr int count = sizeof...(Kernels);
+		// the first kernel takes unknown type ids, as the default of the old switch did
+		typedef std::tuple_element_t<0, std::tuple<Kernels...>> Fallback;
+		static constexpr int Resolve(int type) { return ((type == Kernels::type) || ...) ? type : Fallback::type; }
+		// call f(Kernel()) for the kernel whose type id matches
+		template <class F> static void Visit(int type, F&& f) { if (!((type == Kernels::type ? (f(Kernels()), true) : false) || ...)) f(Fallback()); }
+		// call f(Kernel()) for every kernel, unrolled at compile time
+		template <class F> static void ForEach(F&& f) { (f(Kernels()), ...); }
+	};
+
+	typedef PrimitiveTypeList<TriangleKernel, SphereKernel, PlaneKernel, CubeKernel, QuadKernel, MeshKernel> PrimitiveTypes;
+	static_assert(PrimitiveTypes::count <= MAX_PRIMITIVE_TYPES, "raise MAX_PRIMITIVE_TYPES in bvh.h");
+
+	inline AABB PrimitiveUtils::GetBounds(Primitive& p)
+	{
+		AABB aabb;
+		PrimitiveTypes::Visit(p.type, [&](auto kernel) { aabb = decltype(kernel)::GetBounds(p); });
+		return aabb;
+	}
+
+	inline float3 PrimitiveUtils::GetNormal(Primitive& p, float3 I, int primIdx)
+	{
+		float3 N(0);
+		PrimitiveTypes::Visit(p.type, [&](auto kernel) { N = decltype(kernel)::GetNormal(p, I, primIdx); });
+		return N;
+	}
+
+	inline void PrimitiveUtils::Intersect(Primitive& p, Ray& ray)
+	{
+		PrimitiveTypes::Visit(p.type, [&](auto kernel) { decltype(kernel)::Intersect(p, ray); });
+	}
+
+	inline void PrimitiveUtils::IntersectSwitch(Primitive& p, Ray& ray)
+	{
+		switch (p.type)
+		{
+			case 0:
+			default:
+				IntersectTriangle(p, ray);
+				break;
+			case 1:
+				IntersectSphere(p, ray);
+				break;
+			case 2:
+				IntersectPlane(p, ray);
+				break;
+			case 3:
+				IntersectCube(p, ray);
+				break;
+			case 4:
+				IntersectQuad(p, ray);
+				break;
+			case 5:
+				MeshKernel::Intersect(p, ray);
+				break;
+		}
+	}
+
 	class PrimitiveFactory {
 	public:
 		static Primitive GenerateTriangle(int objId, int matIdx, float3 vertex0, float3 vertex1, float3 vertex2, mat4 transform = mat4::Identity()) 
@@ -338,6 +551,17 @@ namespace Tmpl8 {
 			return primitive;
 		}
 
+		static Primitive GenerateMesh(int objId, int matIdx, Mesh* mesh, mat4 transform = mat4::Identity())
+		{
+			Primitive primitive;
+			primitive.objIdx = objId;
+			primitive.matIdx = matIdx;
+			primitive.type = 5;
+			primitive.mesh = mesh;
+			primitive.T = transform, primitive.invT = transform.FastInvertedTransformNoScale();
+			return primitive;
+		}
+
 		static Primitive GenerateQuad(int objId, int matIdx, float s, mat4 transform = mat4::Identity())
 		{
 			Primitive primitive;
@@ -0,0 +1,137 @@
+#pragma once
+
+// world-space radiance cache: a hash table of grid cells, each holding the
+// radiance leaving the diffuse surfaces inside it (Binder et al., Massively
+// Parallel Path Space Filtering 2019). Cells grow with the distance to the camera
+#define RADIANCE_CACHE_SIZE		(1 << 19)	// cells; a power of two
+#define RADIANCE_CACHE_PROBES	8			// linear probing steps before giving up
+#define RADIANCE_CACHE_MAX_VERTICES	16		// training records per path
+
+namespace Tmpl8 {
+	struct RadianceCacheCell
+	{
+		RadianceCacheCell() = default;
+		RadianceCacheCell(const RadianceCacheCell& other) { *this = other; }
+		RadianceCacheCell& operator=(const RadianceCacheCell& other)
+		{
+			// not atomic as a whole; cells are only copied between frames
+			key.store(other.key.load()), count.store(other.count.load());
+			for (int i = 0; i < 3; i++) sum[i] = other.sum[i];
+			value = other.value, samples = other.samples, lastFrame = other.lastFrame;
+			return *this;
+		}
+		std::atomic<uint64_t> key{ 0 };	// 0: empty
+		AtomicFloat sum[3];				// recorded this frame
+		std::atomic<uint> count{ 0 };
+		float3 value = 0;				// resolved over all frames so far
+		uint samples = 0;
+		uint lastFrame = 0;				// the last frame with records
+	};
+
+	class RadianceCache
+	{
+	public:
+		void Init()
+		{
+			cells.assign(RADIANCE_CACHE_SIZE, RadianceCacheCell());
+			usedCells = 0, frame = 0;
+		}
+
+		int Level(const float3 P) const
+		{
+			// cells double in size with every doubling of the distance to the camera
+			const float d = max(length(P - cameraPos), 1e-3f) * (1 / levelDistance);
+			return clamp((int)floorf(log2f(d)) + 16, 0, 31);
+		}
+
+		float CellSize(const int level) const { return ldexpf(cellSize, level - 16); }
+		float CellSize(const float3 P) const { return CellSize(Level(P)); }
+
+		static uint64_t Key(const float3 P, const float3 N, const int level, const float size)
+		{
+			// 17 bits per axis, 5 for the level and 3 for the dominant axis of the
+			// normal and its sign: opposite sides of a thin wall get separate cells
+			const float3 p = P * (1 / size);
+			const uint64_t x = (uint64_t)((int64_t)floorf(p.x) & 0x1ffff), y = (uint64_t)((int64_t)floorf(p.y) & 0x1ffff), z = (uint64_t)((int64_t)floorf(p.z) & 0x1ffff);
+			const float3 a = fabs(N);
+			const uint64_t axis = a.x > a.y && a.x > a.z ? 0 : a.y > a.z ? 1 : 2, sign = (axis == 0 ? N.x : axis == 1 ? N.y : N.z) < 0;
+			return (x | y << 17 | z << 34 | (uint64_t)level << 51 | (axis * 2 + sign) << 56) + 1;
+		}
+
+		static uint Slot(const uint64_t key) { return SamplerUtils::Hash((uint)key ^ SamplerUtils::Hash((uint)(key >> 32))) & (RADIANCE_CACHE_SIZE - 1); }
+
+		RadianceCacheCell* Find(const float3 P, const float3 N, const bool insert)
+		{
+			const int level = Level(P);
+			const uint64_t key = Key(P, N, level, CellSize(level));
+			for (uint i = 0, slot = Slot(key); i < RADIANCE_CACHE_PROBES; i++, slot = (slot + 1) & (RADIANCE_CACHE_SIZE - 1))
+			{
+				uint64_t current = cells[slot].key.load(std::memory_order_relaxed);
+				if (current == key) return &cells[slot];
+				if (current != 0) continue;
+				if (!insert) return 0;
+				// claim the empty slot; another thread may have claimed it for the same cell
+				if (cells[slot].key.compare_exchange_strong(current, key)) return &cells[slot];
+				if (current == key) return &cells[slot];
+			}
+			return 0; // the neighbourhood is full
+		}
+
+		bool Lookup(const float3 P, const float3 N, float3& value)
+		{
+			const RadianceCacheCell* cell = Find(P, N, false);
+			if (!cell || cell->samples < minSamples) return false;
+			value = cell->value;
+			return true;
+		}
+
+		void Record(const float3 P, const float3 N, const float3 value)
+		{
+			RadianceCacheCell* cell = Find(P, N, true);
+			if (!cell) return;
+			cell->sum[0].Add(value.x), cell->sum[1].Add(value.y), cell->sum[2].Add(value.z);
+			cell->count++;
+		}
+
+		// once per frame, after all paths were traced: this frame's records are
+		// blended in, as a running mean that turns into a moving average after
+		// maxSamples, so the cache follows changes in the lighting. A cell without
+		// records for maxAge frames is freed; a freed slot ends the probe sequence
+		// of cells behind it, which are then recorded anew and age out as well
+		void Update(const float3 camera)
+		{
+			int used = 0;
+			#pragma omp parallel for schedule(static, 4096) reduction(+: used)
+			for (int i = 0; i < RADIANCE_CACHE_SIZE; i++)
+			{
+				RadianceCacheCell& cell = cells[i];
+				if (cell.key.load(std::memory_order_relaxed) == 0) continue;
+				const uint count = cell.count.load(std::memory_order_relaxed);
+				if (!count)
+				{
+					if (frame - cell.lastFrame >= maxAge) cell = RadianceCacheCell(); else used++;
+					continue;
+				}
+				used++, cell.lastFrame = frame;
+				const float3 sum(cell.sum[0].Load(), cell.sum[1].Load(), cell.sum[2].Load());
+				cell.samples = min(cell.samples + count, maxSamples);
+				cell.value += (sum - cell.value * (float)count) * (1.0f / max(cell.samples, count));
+				cell.sum[0] = cell.sum[1] = cell.sum[2] = AtomicFloat(0), cell.count = 0;
+			}
+			usedCells = used, frame++;
+			// after the camera moved, points may map to cells of another size, which
+			// fill up anew while the old ones age out
+			cameraPos = camera;
+		}
+
+		vector<RadianceCacheCell> cells;
+		int usedCells = 0;
+		uint frame = 0;					// Update calls since Init
+		float3 cameraPos = 0;
+		float cellSize = 0.2f;			// world size of a cell at levelDistance from the camera
+		float levelDistance = 2;
+		uint minSamples = 16;		// a cell answers lookups from this many records on
+		uint maxSamples = 1024;
+		uint maxAge = 64;				// frames without records before a cell is freed
+	};
+}
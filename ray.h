@@ -1,15 +1,23 @@
 #pragma once
 #define SPEEDTRIX
 
+// visibility classes: a primitive lists the ray classes that can hit it,
+// a ray carries its own class; BVH nodes store the OR of their primitives
+#define VIS_CAMERA	1	// primary rays
+#define VIS_BOUNCE	2	// reflection, refraction and diffuse bounces
+#define VIS_SHADOW	4	// occlusion queries: the primitive casts shadows
+#define VIS_EMITTER	8	// light sampling rays
+#define VIS_ALL		15
+
 namespace Tmpl8 {
 
 	__declspec(align(64)) class Ray
 	{
 	public:
 		Ray() = default;
-		Ray(float3 origin, float3 direction, float distance = 1e34f)
+		Ray(float3 origin, float3 direction, float distance = 1e34f, uint visibility = VIS_BOUNCE)
 		{
-			O = origin, D = direction, t = distance;
+			O = origin, D = direction, t = distance, mask = visibility;
 			// calculate reciprocal ray direction for triangles and AABBs
 			rD = float3(1 / D.x, 1 / D.y, 1 / D.z);
 #ifdef SPEEDTRIX
@@ -27,6 +35,9 @@ namespace Tmpl8 {
 #endif
 		float t = 1e34f;
 		int objIdx = -1;
+		float u = 0, v = 0; // barycentrics of a triangle hit
+		int primIdx = -1; // triangle index of a mesh hit
+		uint mask = VIS_BOUNCE; // visibility class of this ray
 		bool inside = false; // true when in medium
 	};
 }
\ No newline at end of file
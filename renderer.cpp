@@ -8,6 +8,22 @@ void Renderer::Init()
 	// create fp32 rgb pixel buffer to render to
 	accumulator = (float4*)MALLOC64( SCRWIDTH * SCRHEIGHT * 16 );
 	memset( accumulator, 0, SCRWIDTH * SCRHEIGHT * 16 );
+	reservoirs = new Reservoir[SCRWIDTH * SCRHEIGHT];
+	prevReservoirs = new Reservoir[SCRWIDTH * SCRHEIGHT];
+	primaryHits = new ShadingData[SCRWIDTH * SCRHEIGHT];
+	pixelSampleCount = new uint[SCRWIDTH * SCRHEIGHT]();
+	pixelM2 = new float[SCRWIDTH * SCRHEIGHT]();
+	tileActive = new bool[TILES_X * TILES_Y];
+	pixelObjIdx = new int[SCRWIDTH * SCRHEIGHT];
+	isEdge = new bool[SCRWIDTH * SCRHEIGHT];
+	denoised = (float4*)MALLOC64( SCRWIDTH * SCRHEIGHT * 16 );
+	gbuffer.Init( SCRWIDTH, SCRHEIGHT );
+	denoiser.Init( SCRWIDTH, SCRHEIGHT );
+	prevGBuffer.Init( SCRWIDTH, SCRHEIGHT );
+	history = (float4*)MALLOC64( SCRWIDTH * SCRHEIGHT * 16 );
+	historySampleCount = new uint[SCRWIDTH * SCRHEIGHT]();
+	historyM2 = new float[SCRWIDTH * SCRHEIGHT]();
+	historyPixel = new int[SCRWIDTH * SCRHEIGHT];
 	
 	switch (rendererModuleType)
 	{
@@ -17,16 +33,44 @@ void Renderer::Init()
 		case RendererModuleType::PathTrace:
 			pathTracerModule = PathTraceModule();
 			break;
+		case RendererModuleType::Wavefront:
+			wavefrontModule = WavefrontPathTraceModule();
+			break;
 		default:
 			whittedStyleRayTraceModule = WhittedStyleRayTraceModule();
 			break;
 	}
 }
 
+// -----------------------------------------------------------
+// Release the per-pixel buffers
+// -----------------------------------------------------------
+void Renderer::Shutdown()
+{
+	delete[] reservoirs;
+	delete[] prevReservoirs;
+	delete[] primaryHits;
+	delete[] pixelSampleCount;
+	delete[] pixelM2;
+	delete[] tileActive;
+	delete[] pixelObjIdx;
+	delete[] isEdge;
+	FREE64( denoised );
+	gbuffer.Free();
+	prevGBuffer.Free();
+	denoiser.Free();
+	// Reproject swaps these with their history, so each pair is freed on both sides
+	FREE64( accumulator );
+	FREE64( history );
+	delete[] historySampleCount;
+	delete[] historyM2;
+	delete[] historyPixel;
+}
+
 // -----------------------------------------------------------
 // Evaluate light transport
 // -----------------------------------------------------------
-float3 Renderer::Trace( Ray& ray)
+float3 Renderer::Trace( Ray& ray, const Sampler& sampler, WhittedShadowBatch* shadows )
 {
 	switch (rendererModuleType)
 	{
@@ -35,24 +79,310 @@ float3 Renderer::Trace( Ray& ray)
 			{
 				whittedStyleRayTraceModule.Init(scene);
 			}
-			return whittedStyleRayTraceModule.Trace(ray, 1);
+			return whittedStyleRayTraceModule.Trace(ray, 1, sampler, shadows);
 		case RendererModuleType::PathTrace:
 			if (pathTracerModule.isInitialized == false)
 			{
 				pathTracerModule.Init(scene);
 			}
-			return pathTracerModule.Trace(ray);
+			return pathTracerModule.Trace(ray, sampler);
 		default:
 			if (whittedStyleRayTraceModule.isInitialized == false)
 			{
 				whittedStyleRayTraceModule.Init(scene);
 			}
-			return whittedStyleRayTraceModule.Trace(ray, 1);
+			return whittedStyleRayTraceModule.Trace(ray, 1, sampler, shadows);
 	}
 
 	
 }
 
+// -----------------------------------------------------------
+// Direct light resampling, pass 1: primary hits, initial
+// candidates and temporal reuse
+// -----------------------------------------------------------
+void Renderer::ReSTIRInitialPass()
+{
+	if (pathTracerModule.isInitialized == false)
+	{
+		pathTracerModule.Init( scene );
+	}
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < SCRHEIGHT; y++) for (int x = 0; x < SCRWIDTH; x++)
+	{
+		int pixel = x + y * SCRWIDTH;
+		Ray ray = camera.GetPrimaryRay( x, y );
+		scene.FindNearest( ray );
+		ShadingData& hit = primaryHits[pixel];
+		hit.objIdx = -1;
+		reservoirs[pixel] = Reservoir();
+		if (ray.objIdx == -1) continue;
+		scene.GetShadingData( ray, hit );
+		if (!ReSTIRUtils::IsDiffuse( *hit.material )) continue;
+		const float3 wo = -ray.D;
+		PCG32 rng = Sampler( x, y, samepleCount, samplerType ).Stream( STREAM_RESTIR_CANDIDATES );
+		Reservoir r = ReSTIRUtils::SampleLights( scene, hit, wo, restirCandidates, rng );
+		// visibility reuse: occluded samples are not passed on to the neighbours;
+		// wSum goes too, or Finalize would revive them, while M still counts the candidates
+		if (r.W > 0 && !ReSTIRUtils::IsVisible( scene, hit, r.P )) r.W = r.wSum = 0;
+		// temporal reuse: last frame's reservoir for the same pixel, or for the
+		// pixel the primary hit was reprojected from
+		const int prevPixel = reprojected ? historyPixel[pixel] : pixel;
+		if (samepleCount > 0 && prevPixel >= 0 && prevReservoirs[prevPixel].M > 0)
+		{
+			Reservoir prev = prevReservoirs[prevPixel];
+			prev.M = min( prev.M, 20 * r.M );
+			ReSTIRUtils::Combine( r, prev, ReSTIRUtils::TargetPdf( scene, hit, wo, prev.light, prev.P, prev.lightN ), rng.NextFloat() );
+			ReSTIRUtils::Finalize( r, ReSTIRUtils::TargetPdf( scene, hit, wo, r.light, r.P, r.lightN ) );
+		}
+		reservoirs[pixel] = r;
+	}
+}
+
+// -----------------------------------------------------------
+// Direct light resampling, pass 2: spatial reuse, then the
+// path tracer continues from the primary hit
+// -----------------------------------------------------------
+float3 Renderer::TraceReSTIR( int x, int y )
+{
+	int pixel = x + y * SCRWIDTH;
+	const Sampler sampler( x, y, sampleIndexBase + pixelSampleCount[pixel], samplerType );
+	const ShadingData& hit = primaryHits[pixel];
+	Ray ray = camera.GetPrimaryRay( x, y );
+	if (hit.objIdx == -1) return 0;
+	ray.t = length( hit.I - ray.O ), ray.objIdx = hit.objIdx;
+	if (!ReSTIRUtils::IsDiffuse( *hit.material )) return pathTracerModule.Trace( ray, hit, sampler );
+
+	const float3 wo = -ray.D;
+	Reservoir r = reservoirs[pixel];
+	PCG32 rng = sampler.Stream( STREAM_RESTIR_REUSE );
+	for (int i = 0; i < restirSpatialSamples; i++)
+	{
+		int nx = x + (int)((rng.NextFloat() * 2 - 1) * restirSpatialRadius);
+		int ny = y + (int)((rng.NextFloat() * 2 - 1) * restirSpatialRadius);
+		if (nx < 0 || ny < 0 || nx >= SCRWIDTH || ny >= SCRHEIGHT || (nx == x && ny == y)) continue;
+		const ShadingData& other = primaryHits[nx + ny * SCRWIDTH];
+		// only reuse from similar surfaces
+		if (other.objIdx == -1 || dot( other.N, hit.N ) < 0.9f) continue;
+		float depth = ray.t, otherDepth = length( other.I - ray.O );
+		if (fabs( otherDepth - depth ) > 0.1f * depth) continue;
+		const Reservoir& n = reservoirs[nx + ny * SCRWIDTH];
+		ReSTIRUtils::Combine( r, n, ReSTIRUtils::TargetPdf( scene, hit, wo, n.light, n.P, n.lightN ), rng.NextFloat() );
+	}
+	ReSTIRUtils::Finalize( r, ReSTIRUtils::TargetPdf( scene, hit, wo, r.light, r.P, r.lightN ) );
+	prevReservoirs[pixel] = r;
+
+	float3 direct( 0 );
+	if (r.W > 0 && ReSTIRUtils::IsVisible( scene, hit, r.P ))
+		direct = ReSTIRUtils::Contribution( scene, hit, wo, r.light, r.P, r.lightN ) * r.W;
+	return pathTracerModule.Trace( ray, hit, sampler, &direct );
+}
+
+// -----------------------------------------------------------
+// One sample for a pixel; with anti-aliasing, the primary ray
+// is jittered over the pixel footprint
+// -----------------------------------------------------------
+float3 Renderer::TracePixel( int x, int y, bool restir, WhittedShadowBatch* shadows )
+{
+	const int pixel = x + y * SCRWIDTH;
+	if (restir)
+	{
+		pixelObjIdx[pixel] = primaryHits[pixel].objIdx;
+		return TraceReSTIR( x, y );
+	}
+	Sampler sampler( x, y, sampleIndexBase + pixelSampleCount[pixel], samplerType );
+	Ray ray = isAntiAlisingOn ? camera.GetPrimaryRay( x + sampler.Next() - 0.5f, y + sampler.Next() - 0.5f ) : camera.GetPrimaryRay( x, y );
+	float3 color = Trace( ray, sampler, shadows );
+	pixelObjIdx[pixel] = ray.objIdx;
+	return color;
+}
+
+void Renderer::TraceWavefront( const vector<int>& pixels, int passes )
+{
+	// passes samples for each pixel, traced as one batch
+	if (wavefrontModule.isInitialized == false)
+	{
+		wavefrontModule.Init( scene );
+	}
+	// the same paths as the path tracer module, toggled by the same keys
+	wavefrontModule.useNEE = pathTracerModule.useNEE;
+	wavefrontModule.sampleCount = pathTracerModule.sampleCount;
+	wavefrontModule.depthLimit = pathTracerModule.depthLimit;
+	wavefrontModule.russianRouletteDepth = pathTracerModule.russianRouletteDepth;
+	const int count = (int)pixels.size();
+	wavefrontSamplers.resize( count * passes, Sampler( 0, 0, 0 ) );
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < count; i++)
+	{
+		const int pixel = pixels[i];
+		for (int pass = 0; pass < passes; pass++)
+			wavefrontSamplers[i * passes + pass] = Sampler( pixel % SCRWIDTH, pixel / SCRWIDTH, sampleIndexBase + pixelSampleCount[pixel] + pass, samplerType );
+	}
+	wavefrontModule.Render( camera, wavefrontSamplers, isAntiAlisingOn, wavefrontResult, wavefrontObjIdx );
+	#pragma omp parallel for schedule(static)
+	for (int i = 0; i < count; i++)
+	{
+		const int pixel = pixels[i];
+		for (int pass = 0; pass < passes; pass++) AddSample( pixel, wavefrontResult[i * passes + pass] );
+		pixelObjIdx[pixel] = wavefrontObjIdx[i * passes + passes - 1];
+	}
+}
+
+bool Renderer::IsEdge( int x, int y ) const
+{
+	// a neighbour shows another object, or differs in luminance by more than
+	// aaContrast (relative, with the same dark floor as convergence)
+	const int pixel = x + y * SCRWIDTH;
+	const float lum = Luminance( make_float3( accumulator[pixel] ) );
+	const int2 offset[4] = { int2( -1, 0 ), int2( 1, 0 ), int2( 0, -1 ), int2( 0, 1 ) };
+	for (int i = 0; i < 4; i++)
+	{
+		const int nx = x + offset[i].x, ny = y + offset[i].y;
+		if (nx < 0 || ny < 0 || nx >= SCRWIDTH || ny >= SCRHEIGHT) continue;
+		const int other = nx + ny * SCRWIDTH;
+		if (pixelObjIdx[other] != pixelObjIdx[pixel]) return true;
+		const float otherLum = Luminance( make_float3( accumulator[other] ) );
+		if (fabs( lum - otherLum ) > aaContrast * max( max( lum, otherLum ), 0.1f )) return true;
+	}
+	return false;
+}
+
+// -----------------------------------------------------------
+// G-buffer for the denoiser: attributes of the unjittered
+// primary hit of every pixel
+// -----------------------------------------------------------
+void Renderer::UpdateGBuffer()
+{
+	#pragma omp parallel for schedule(dynamic)
+	for (int y = 0; y < SCRHEIGHT; y++) for (int x = 0; x < SCRWIDTH; x++)
+	{
+		Ray ray = camera.GetPrimaryRay( x, y );
+		scene.FindNearest( ray );
+		if (ray.objIdx == -1)
+		{
+			gbuffer.Store( x + y * SCRWIDTH, float3( 0 ), 1e34f, float3( 1 ), -1 );
+			continue;
+		}
+		ShadingData hit;
+		scene.GetShadingData( ray, hit );
+		gbuffer.Store( x + y * SCRWIDTH, hit.N, ray.t, hit.albedo, ray.objIdx );
+	}
+}
+
+// -----------------------------------------------------------
+// Temporal reprojection: carry the accumulated samples over
+// to the new view; called after the camera moved
+// -----------------------------------------------------------
+void Renderer::Reproject()
+{
+	std::swap( gbuffer, prevGBuffer );
+	UpdateGBuffer();
+	std::swap( accumulator, history );
+	std::swap( pixelSampleCount, historySampleCount );
+	std::swap( pixelM2, historyM2 );
+	// reprojected pixels restart at a low sample index: move on to unused
+	// indices, so that consecutive frames do not repeat the same samples
+	sampleIndexBase += 1 << 16;
+	int rejected = 0;
+	#pragma omp parallel for schedule(dynamic) reduction(+: rejected)
+	for (int y = 0; y < SCRHEIGHT; y++) for (int x = 0; x < SCRWIDTH; x++)
+	{
+		const int pixel = x + y * SCRWIDTH, id = gbuffer.objIdx[pixel];
+		const float3 N( gbuffer.nx[pixel], gbuffer.ny[pixel], gbuffer.nz[pixel] );
+		const Ray ray = camera.GetPrimaryRay( x, y );
+		const float3 P = ray.O + ray.D * gbuffer.depth[pixel];
+		const float expectedDepth = length( P - prevCamera.camPos );
+		// bilinear over the four previous pixels around the reprojected position,
+		// each one only if it saw the same surface
+		float4 color( 0 );
+		float count = 0, m2 = 0, weightSum = 0, nearestWeight = 0;
+		int nearest = -1;
+		float2 prev;
+		if (prevCamera.Project( P, prev ))
+		{
+			const int px = (int)floorf( prev.x ), py = (int)floorf( prev.y );
+			const float fx = prev.x - px, fy = prev.y - py;
+			for (int i = 0; i < 4; i++)
+			{
+				const int tx = px + (i & 1), ty = py + (i >> 1);
+				if (tx < 0 || ty < 0 || tx >= SCRWIDTH || ty >= SCRHEIGHT) continue;
+				const int tap = tx + ty * SCRWIDTH;
+				if (prevGBuffer.objIdx[tap] != id) continue;
+				if (id != -1)
+				{
+					const float3 prevN( prevGBuffer.nx[tap], prevGBuffer.ny[tap], prevGBuffer.nz[tap] );
+					if (dot( N, prevN ) < temporalNormalThreshold) continue;
+					if (fabs( prevGBuffer.depth[tap] - expectedDepth ) > temporalDepthThreshold * expectedDepth) continue;
+				}
+				const float w = ((i & 1) ? fx : 1 - fx) * ((i >> 1) ? fy : 1 - fy);
+				color += history[tap] * w, count += historySampleCount[tap] * w, m2 += historyM2[tap] * w;
+				weightSum += w;
+				if (w > nearestWeight) nearestWeight = w, nearest = tap;
+			}
+		}
+		historyPixel[pixel] = nearest;
+		pixelObjIdx[pixel] = id;
+		if (weightSum < 1e-3f)
+		{
+			// disoccluded: start over
+			accumulator[pixel] = float4( 0 );
+			pixelSampleCount[pixel] = 0, pixelM2[pixel] = 0;
+			rejected++;
+			continue;
+		}
+		// keep the variance estimate, rescaled to the capped sample count
+		const float n = count / weightSum;
+		const uint capped = min( (uint)(n + 0.5f), temporalMaxHistory );
+		accumulator[pixel] = color / weightSum;
+		pixelSampleCount[pixel] = capped;
+		pixelM2[pixel] = n > 1 && capped > 1 ? m2 / weightSum * (capped - 1) / (n - 1) : 0;
+	}
+	rejectedPixels = rejected;
+}
+
+// -----------------------------------------------------------
+// Adaptive sampling: fold a sample into the pixel's running
+// mean, and track the variance of its luminance (Welford)
+// -----------------------------------------------------------
+void Renderer::AddSample( int pixel, const float3 color )
+{
+	const uint n = ++pixelSampleCount[pixel];
+	float4& mean = accumulator[pixel];
+	const float lum = Luminance( color ), delta = lum - Luminance( make_float3( mean ) );
+	mean += (float4( color, 0 ) - mean) / (float)n;
+	pixelM2[pixel] += delta * (lum - Luminance( make_float3( mean ) ));
+}
+
+bool Renderer::IsConverged( int pixel ) const
+{
+	// relative standard error of the mean below the threshold; dark pixels are
+	// judged against a floor, so that they do not chase absolute noise
+	const uint n = pixelSampleCount[pixel];
+	if (n < adaptiveMinSamples) return false;
+	const float variance = pixelM2[pixel] / (n - 1);
+	return variance / n < sqrf( adaptiveThreshold * max( Luminance( make_float3( accumulator[pixel] ) ), 0.1f ) );
+}
+
+int Renderer::ScheduleTiles( int& activeTiles, const bool adaptive )
+{
+	// a tile stays active while any of its pixels has not converged; returns
+	// the number of unconverged pixels
+	int activePixels = 0, tiles = 0;
+	#pragma omp parallel for schedule(dynamic) reduction(+: activePixels, tiles)
+	for (int tile = 0; tile < TILES_X * TILES_Y; tile++)
+	{
+		const int x0 = (tile % TILES_X) * TILE_SIZE, y0 = (tile / TILES_X) * TILE_SIZE;
+		const int x1 = min( x0 + TILE_SIZE, SCRWIDTH ), y1 = min( y0 + TILE_SIZE, SCRHEIGHT );
+		int pixels = 0;
+		for (int y = y0; y < y1; y++) for (int x = x0; x < x1; x++)
+			pixels += !adaptive || !IsConverged( x + y * SCRWIDTH );
+		tileActive[tile] = pixels > 0;
+		activePixels += pixels, tiles += pixels > 0;
+	}
+	activeTiles = tiles;
+	return activePixels;
+}
+
 // -----------------------------------------------------------
 // Main application tick function - Executed once per frame
 // -----------------------------------------------------------
@@ -74,10 +404,13 @@ void Renderer::Tick( float deltaTime )
 		camera.Move(verticalInput, horizontalInput, deltaTime);
 	}
 
+	reprojected = false;
 	if (camera.isUpdated)
 	{
 		camera.UpdateView();
-		samepleCount = 0;
+		// reprojection needs the G-buffer of the previous view
+		if (useTemporalReprojection && samepleCount > 0 && !gBufferDirty) Reproject(), reprojected = true;
+		else samepleCount = 0;
 	}
 
 	if (samepleCount == maxSampleCount)
@@ -85,45 +418,132 @@ void Renderer::Tick( float deltaTime )
 		samepleCount = 0;
 	}
 
-	// lines are executed as OpenMP parallel tasks (disabled in DEBUG)
-	#pragma omp parallel for schedule(dynamic)
-	for (int y = 0; y < SCRHEIGHT; y++)
+	// light resampling works on unjittered primary hits, so the first sample of an
+	// anti-aliased pixel is traced without it
+	bool restir = useReSTIR && rendererModuleType == RendererModuleType::PathTrace && !isAntiAlisingOn;
+	if (restir) ReSTIRInitialPass();
+
+	if (samepleCount == 0)
+	{
+		memset( pixelSampleCount, 0, SCRWIDTH * SCRHEIGHT * sizeof( uint ) );
+		memset( pixelM2, 0, SCRWIDTH * SCRHEIGHT * sizeof( float ) );
+		sampleIndexBase = 0;
+		gBufferDirty = true;
+	}
+	if ((useDenoiser || useTemporalReprojection) && gBufferDirty) UpdateGBuffer(), gBufferDirty = false;
+
+	// caustics: a photon pass per frame, with a radius that shrinks as the frames accumulate
+	const bool photons = rendererModuleType == RendererModuleType::PathTrace && pathTracerModule.usePhotonMap;
+	float photonTime = 0;
+	if (photons)
 	{
-		// trace a primary ray for each pixel on the line
-		for (int x = 0; x < SCRWIDTH; x++)
+		Timer photonTimer;
+		pathTracerModule.photonMap.Emit( scene, samepleCount );
+		photonTime = photonTimer.elapsed() * 1000;
+	}
+
+	// adaptive sampling: converged pixels, and tiles in which every pixel
+	// converged, are skipped; the frame's ray budget is spread over the rest.
+	// Temporal reuse correlates the frames of a ReSTIR pixel, so its variance
+	// says little about its error; and every pixel has to renew its reservoir
+	// and primary object, which the next frame reuses
+	const bool adaptive = useAdaptiveSampling && !restir;
+	int activeTiles, edgePixels = 0, passes = 1;
+	int activePixels = ScheduleTiles( activeTiles, adaptive );
+	if (!restir && activePixels > 0) passes = clamp( SCRWIDTH * SCRHEIGHT / activePixels, 1, adaptiveMaxPasses );
+	const bool wavefront = rendererModuleType == RendererModuleType::Wavefront;
+	if (wavefront)
+	{
+		wavefrontModule.ResetStats();
+		wavefrontPixels.clear();
+		for (int tile = 0; tile < TILES_X * TILES_Y; tile++)
+		{
+			if (!tileActive[tile]) continue;
+			const int x0 = (tile % TILES_X) * TILE_SIZE, y0 = (tile / TILES_X) * TILE_SIZE;
+			for (int y = y0; y < min( y0 + TILE_SIZE, SCRHEIGHT ); y++) for (int x = x0; x < min( x0 + TILE_SIZE, SCRWIDTH ); x++)
+				if (!(adaptive && IsConverged( x + y * SCRWIDTH ))) wavefrontPixels.push_back( x + y * SCRWIDTH );
+		}
+		TraceWavefront( wavefrontPixels, passes );
+	}
+	else
+	{
+		// Whitted frames may trace the shadow rays of a tile in one batch, once
+		// all of its pixels are done
+		const bool shadowBatches = rendererModuleType == RendererModuleType::WhittedStyle && whittedStyleRayTraceModule.deferShadows;
+		#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < TILES_X * TILES_Y; tile++)
 		{
-			if (isAntiAlisingOn)
+			if (!tileActive[tile]) continue;
+			const int x0 = (tile % TILES_X) * TILE_SIZE, y0 = (tile / TILES_X) * TILE_SIZE;
+			WhittedShadowBatch batch;
+			for (int y = y0; y < min( y0 + TILE_SIZE, SCRHEIGHT ); y++) for (int x = x0; x < min( x0 + TILE_SIZE, SCRWIDTH ); x++)
 			{
-				float sampleMatrix[4 * 2] = {
-					-Rand(2.f) / 4.f,  Rand(2.f) / 4.f,
-					-Rand(2.f) / 4.f, -Rand(2.f) / 4.f,
-					 Rand(2.f) / 4.f,  Rand(2.f) / 4.f,
-					 Rand(2.f) / 4.f, -Rand(2.f) / 4.f,
-				};
-				for (int sample = 0; sample < 4; sample++)
+				const int pixel = x + y * SCRWIDTH;
+				if (adaptive && IsConverged( pixel )) continue;
+				for (int pass = 0; pass < passes; pass++)
 				{
-					accumulator[x + y * SCRWIDTH] += float4(
-						Trace(camera.GetPrimaryRay((float)x + sampleMatrix[2 * sample], (float)y + sampleMatrix[2 * sample + 1])), 0);
+					if (!shadowBatches) { AddSample( pixel, TracePixel( x, y, restir ) ); continue; }
+					const float3 color = TracePixel( x, y, restir, &batch );
+					batch.samples.push_back( color ), batch.pixels.push_back( pixel );
 				}
-				// take average
-				accumulator[x + y * SCRWIDTH] /= 4.0f;
 			}
-			else
+			if (!shadowBatches) continue;
+			whittedStyleRayTraceModule.ResolveShadows( batch );
+			for (int i = 0; i < (int)batch.samples.size(); i++) AddSample( batch.pixels[i], batch.samples[i] );
+		}
+	}
+	int tracedSamples = activePixels * passes;
+
+	if (isAntiAlisingOn)
+	{
+		// edge-adaptive anti-aliasing: pixels on an object boundary or a contrast
+		// step get extra jittered samples, folded into the same running mean
+		#pragma omp parallel for schedule(dynamic) reduction(+: edgePixels)
+		for (int y = 0; y < SCRHEIGHT; y++) for (int x = 0; x < SCRWIDTH; x++)
+		{
+			const int pixel = x + y * SCRWIDTH;
+			isEdge[pixel] = !(adaptive && IsConverged( pixel )) && IsEdge( x, y );
+			edgePixels += isEdge[pixel];
+		}
+		if (wavefront)
+		{
+			wavefrontPixels.clear();
+			for (int pixel = 0; pixel < SCRWIDTH * SCRHEIGHT; pixel++) if (isEdge[pixel]) wavefrontPixels.push_back( pixel );
+			TraceWavefront( wavefrontPixels, aaEdgeSamples );
+		}
+		else
+		{
+			#pragma omp parallel for schedule(dynamic)
+			for (int y = 0; y < SCRHEIGHT; y++) for (int x = 0; x < SCRWIDTH; x++)
 			{
-				if (samepleCount == 0)
-				{
-					accumulator[x + y * SCRWIDTH] = float4(Trace(camera.GetPrimaryRay(x, y)), 0);
-				}
-				else
-				{
-					float4 color = float4(Trace(camera.GetPrimaryRay(x, y)), 0);
-					float4 last = accumulator[x + y * SCRWIDTH];
-					accumulator[x + y * SCRWIDTH] = last + ((color - last) / samepleCount);
-				}
+				const int pixel = x + y * SCRWIDTH;
+				if (isEdge[pixel]) for (int i = 0; i < aaEdgeSamples; i++) AddSample( pixel, TracePixel( x, y, false ) );
 			}
 		}
-		 
-		// translate accumulator contents to rgb32 pixels
+		tracedSamples += edgePixels * aaEdgeSamples;
+	}
+
+	// the guide and the radiance cache learn from this frame's paths
+	const bool guiding = rendererModuleType == RendererModuleType::PathTrace && pathTracerModule.useGuiding;
+	if (guiding) pathTracerModule.guide.Update();
+	const bool caching = rendererModuleType == RendererModuleType::PathTrace && pathTracerModule.useRadianceCache;
+	if (caching) pathTracerModule.radianceCache.Update( camera.camPos );
+
+	// the denoiser writes a separate buffer: the accumulator keeps the unfiltered mean
+	const float4* output = accumulator;
+	float denoiseTime = 0;
+	if (useDenoiser)
+	{
+		Timer denoiseTimer;
+		denoiser.Filter( accumulator, pixelSampleCount, pixelM2, gbuffer, denoised );
+		output = denoised;
+		denoiseTime = denoiseTimer.elapsed() * 1000;
+	}
+
+	// translate accumulator contents to rgb32 pixels
+	#pragma omp parallel for
+	for (int y = 0; y < SCRHEIGHT; y++)
+	{
 		for (int dest = y * SCRWIDTH, x = 0; x < SCRWIDTH; x++)
 		{
 			//for (auto it = frameCaches.begin(); it != frameCaches.end(); it++)
@@ -134,15 +554,32 @@ void Renderer::Tick( float deltaTime )
 			//accumulator[x + y * SCRWIDTH] /= (float)(frameCaches.size() + 1);
 
 			screen->pixels[dest + x] =
-				RGBF32_to_RGB8(&accumulator[x + y * SCRWIDTH]);
+				RGBF32_to_RGB8(&output[x + y * SCRWIDTH]);
 		}
 	}
 	// performance report - running average - ms, MRays/s
 	static float avg = 10, alpha = 1;
 	avg = (1 - alpha) * avg + alpha * t.elapsed() * 1000;
 	if (alpha > 0.05f) alpha *= 0.5f;
-	float fps = 1000 / avg, rps = (SCRWIDTH * SCRHEIGHT) * fps;
+	float fps = 1000 / avg, rps = tracedSamples * fps;
 	printf( "%5.2fms (%.1fps) - %.1fMrays/s\n", avg, fps, rps / 1000000 );
+	if (adaptive)
+		printf( "adaptive: %d/%d tiles active, %.1f%% of pixels converged, %d spp on the rest\n",
+			activeTiles, TILES_X * TILES_Y, 100.0f * (1 - (float)activePixels / (SCRWIDTH * SCRHEIGHT)), passes );
+	if (reprojected) printf( "reprojection: %.1f%% of pixels disoccluded\n", 100.0f * rejectedPixels / (SCRWIDTH * SCRHEIGHT) );
+	if (guiding) printf( "guiding: iteration %d, %d spatial nodes\n", pathTracerModule.guide.iteration, (int)pathTracerModule.guide.nodes.size() );
+	if (photons) printf( "photons: %d caustic photons stored, radius %.4f, %.2fms\n", (int)pathTracerModule.photonMap.sorted.size(), sqrtf( pathTracerModule.photonMap.radius2 ), photonTime );
+	if (caching) printf( "radiance cache: %d of %d cells used\n", pathTracerModule.radianceCache.usedCells, RADIANCE_CACHE_SIZE );
+	if (wavefront)
+	{
+		const float* stage = wavefrontModule.stageTime;
+		printf( "wavefront: generate %.1fms, extend %.1fms, sort %.1fms, shade %.1fms, connect %.1fms, accumulate %.1fms; %d extension rays\n",
+			stage[StageGenerate], stage[StageExtend], stage[StageSort], stage[StageShade], stage[StageConnect], stage[StageAccumulate], wavefrontModule.extensions );
+	}
+	if (useDenoiser) printf( "denoiser: %.2fms\n", denoiseTime );
+	if (isAntiAlisingOn)
+		printf( "anti-aliasing: %.1f%% of pixels on edges, %d extra spp there\n", 100.0f * edgePixels / (SCRWIDTH * SCRHEIGHT), aaEdgeSamples );
 
+	prevCamera = camera;
 	samepleCount++;
 }
\ No newline at end of file
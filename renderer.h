@@ -4,6 +4,9 @@
 #define SCRWIDTH	1280
 #define SCRHEIGHT	720
 #define CACHE_SIZE 10
+#define TILE_SIZE	16
+#define TILES_X		((SCRWIDTH + TILE_SIZE - 1) / TILE_SIZE)
+#define TILES_Y		((SCRHEIGHT + TILE_SIZE - 1) / TILE_SIZE)
 
 namespace Tmpl8
 {
@@ -11,7 +14,8 @@ namespace Tmpl8
 enum RendererModuleType
 {
 	WhittedStyle,
-	PathTrace
+	PathTrace,
+	Wavefront	// the path tracer as a pipeline of batched stages
 };
 
 class Renderer : public TheApp
@@ -19,9 +23,20 @@ class Renderer : public TheApp
 public:
 	// game flow methods
 	void Init();
-	float3 Trace( Ray& ray);
+	float3 Trace( Ray& ray, const Sampler& sampler, WhittedShadowBatch* shadows = 0 );
+	void ReSTIRInitialPass();
+	float3 TraceReSTIR( int x, int y );
+	float3 TracePixel( int x, int y, bool restir, WhittedShadowBatch* shadows = 0 );
+	void TraceWavefront( const vector<int>& pixels, int passes );
+	bool IsEdge( int x, int y ) const;
+	void UpdateGBuffer();
+	void Reproject();
+	void AddSample( int pixel, const float3 color );
+	bool IsConverged( int pixel ) const;
+	int ScheduleTiles( int& activeTiles, const bool adaptive );
+	static float Luminance( const float3 c ) { return dot( c, float3( 0.2126f, 0.7152f, 0.0722f ) ); }
 	void Tick( float deltaTime );
-	void Shutdown() { /* implement if you want to do something on exit */ }
+	void Shutdown();
 	// input handling
 	void MouseUp( int button ) { if (button == GLFW_MOUSE_BUTTON_RIGHT) isMouseButtonRightDown = false; }
 	void MouseDown(int button) { if (button == GLFW_MOUSE_BUTTON_RIGHT) isMouseButtonRightDown = true; }
@@ -48,6 +63,19 @@ public:
 
 		if (key == GLFW_KEY_A) horizontalInput = -1;
 		else if (key == GLFW_KEY_D) horizontalInput = 1;
+
+		if (key == GLFW_KEY_B) scene.BenchmarkDispatch();
+		if (key == GLFW_KEY_N) pathTracerModule.useNEE = !pathTracerModule.useNEE, samepleCount = 0;
+		if (key == GLFW_KEY_R) useReSTIR = !useReSTIR, samepleCount = 0;
+		if (key == GLFW_KEY_G) useDenoiser = !useDenoiser;
+		if (key == GLFW_KEY_F) isAntiAlisingOn = !isAntiAlisingOn, samepleCount = 0;
+		if (key == GLFW_KEY_V) useAdaptiveSampling = !useAdaptiveSampling, samepleCount = 0;
+		if (key == GLFW_KEY_P) pathTracerModule.useGuiding = !pathTracerModule.useGuiding, samepleCount = 0;
+		if (key == GLFW_KEY_K) pathTracerModule.usePhotonMap = !pathTracerModule.usePhotonMap, samepleCount = 0;
+		if (key == GLFW_KEY_C) pathTracerModule.useRadianceCache = !pathTracerModule.useRadianceCache, samepleCount = 0;
+		if (key == GLFW_KEY_T) useTemporalReprojection = !useTemporalReprojection;
+		if (key == GLFW_KEY_H) whittedStyleRayTraceModule.deferShadows = !whittedStyleRayTraceModule.deferShadows;
+		if (key == GLFW_KEY_M) samplerType = (SamplerType)((samplerType + 1) % 3), samepleCount = 0;
 	}
 	// data members
 	bool isMouseButtonRightDown;
@@ -61,9 +89,66 @@ public:
 	RendererModuleType rendererModuleType = RendererModuleType::WhittedStyle;
 	PathTraceModule pathTracerModule;
 	WhittedStyleRayTraceModule whittedStyleRayTraceModule;
+	// wavefront module: the pixels of a frame are gathered into one batch, and
+	// its results added afterwards
+	WavefrontPathTraceModule wavefrontModule;
+	vector<int> wavefrontPixels;
+	vector<Sampler> wavefrontSamplers;
+	vector<float3> wavefrontResult;
+	vector<int> wavefrontObjIdx;
 	Camera camera;
+	// edge-adaptive anti-aliasing: jittered primary rays, and aaEdgeSamples extra
+	// samples per frame for pixels next to another object or a contrast step
 	bool isAntiAlisingOn = false;
+	int* pixelObjIdx;
+	bool* isEdge;
+	int aaEdgeSamples = 3;
+	float aaContrast = 0.1f;
+	SamplerType samplerType = SamplerType::SobolOwen;
 	float4* accumulator;
+	// direct light resampling for the path tracer: the reservoirs after temporal
+	// reuse, and last frame's final reservoirs
+	Reservoir* reservoirs;
+	Reservoir* prevReservoirs;
+	ShadingData* primaryHits;
+	bool useReSTIR = false;
+	int restirCandidates = 32;
+	int restirSpatialSamples = 3;
+	int restirSpatialRadius = 16;
+	// adaptive sampling: per-pixel sample count and Welford M2 of the luminance;
+	// a pixel converged once the relative standard error of its mean is below
+	// adaptiveThreshold
+	uint* pixelSampleCount;
+	float* pixelM2;
+	bool* tileActive;
+	bool useAdaptiveSampling = true;
+	float adaptiveThreshold = 0.02f;
+	uint adaptiveMinSamples = 32;
+	int adaptiveMaxPasses = 8;
+	// denoiser: a-trous filter guided by the primary hit G-buffer, applied to a
+	// copy of the accumulator before display
+	GBuffer gbuffer;
+	Denoiser denoiser;
+	float4* denoised;
+	bool useDenoiser = false;
+	bool gBufferDirty = true;
+	// temporal reprojection: on camera motion, each pixel's primary hit is found
+	// in the previous view and its history carried over, unless the depth, normal
+	// or object there disagree; the history then counts as at most
+	// temporalMaxHistory samples, so that new samples blend in exponentially
+	Camera prevCamera;
+	GBuffer prevGBuffer;
+	float4* history;
+	uint* historySampleCount;
+	float* historyM2;
+	int* historyPixel;
+	bool useTemporalReprojection = true;
+	bool reprojected = false;
+	uint temporalMaxHistory = 8;
+	float temporalNormalThreshold = 0.9f;
+	float temporalDepthThreshold = 0.1f;
+	uint sampleIndexBase = 0;
+	int rejectedPixels = 0;
 	int samepleCount = 0;
 	uint maxSampleCount = 2147483645;
 };
@@ -0,0 +1,84 @@
+#pragma once
+
+namespace Tmpl8 {
+	// weighted reservoir holding one light sample for a pixel's primary hit
+	struct Reservoir
+	{
+		int light = -1;
+		float3 P, lightN;	// the selected point on the light
+		float wSum = 0, M = 0, W = 0;
+	};
+
+	// spatiotemporal resampling of direct light (ReSTIR, Bitterli et al. 2020)
+	class ReSTIRUtils {
+	public:
+		static bool IsDiffuse(const Material& material) { return !material.isLight && !material.isMirror && !material.isGlass; }
+
+		// unshadowed contribution of a point on a light; its luminance is the resampling target
+		static float3 Contribution(const Scene& scene, const ShadingData& hit, const float3 wo, const int light, const float3 P, const float3 lightN)
+		{
+			float3 L = P - hit.I;
+			float dist2 = dot(L, L);
+			L *= 1 / sqrtf(dist2);
+			float cosI = dot(hit.N, L);
+			if (cosI <= 0) return 0;
+			float cosO = fabs(dot(lightN, L));
+			return scene.lights[light].emission * BSDFUtils::Eval(*hit.material, hit.N, wo, L, hit.albedo) * (cosI * cosO / dist2);
+		}
+
+		static float TargetPdf(const Scene& scene, const ShadingData& hit, const float3 wo, const int light, const float3 P, const float3 lightN)
+		{
+			if (light < 0) return 0;
+			return dot(Contribution(scene, hit, wo, light, P, lightN), float3(0.2126f, 0.7152f, 0.0722f));
+		}
+
+		static bool Update(Reservoir& r, const int light, const float3 P, const float3 lightN, const float w, const float M, const float rnd)
+		{
+			r.wSum += w, r.M += M;
+			if (w <= 0 || rnd * r.wSum >= w) return false;
+			r.light = light, r.P = P, r.lightN = lightN;
+			return true;
+		}
+
+		static void Combine(Reservoir& r, const Reservoir& other, const float pHat, const float rnd)
+		{
+			// pHat: target density of the other reservoir's sample at this pixel
+			Update(r, other.light, other.P, other.lightN, pHat * other.W * other.M, other.M, rnd);
+		}
+
+		static void Finalize(Reservoir& r, const float pHat)
+		{
+			r.W = pHat > 0 ? r.wSum / (r.M * pHat) : 0;
+		}
+
+		static Reservoir SampleLights(Scene& scene, const ShadingData& hit, const float3 wo, const int candidateCount, PCG32& rng)
+		{
+			// resampled importance sampling: keep one of many cheap candidates, in
+			// proportion to its unshadowed contribution; the candidates come from the
+			// alias table, the target function does the spatial part
+			Reservoir r;
+			if (scene.lights.empty()) return r;
+			for (int i = 0; i < candidateCount; i++)
+			{
+				int light = scene.lightTable.Sample(rng.NextFloat());
+				float pmf = scene.lightTable.pmf[light];
+				float3 P, lightN;
+				scene.SamplePointOnLight(light, rng.NextFloat(), rng.NextFloat(), P, lightN);
+				float sourcePdf = pmf / scene.lights[light].area; // area measure
+				float pHat = TargetPdf(scene, hit, wo, light, P, lightN);
+				Update(r, light, P, lightN, pHat / sourcePdf, 1, rng.NextFloat());
+			}
+			Finalize(r, TargetPdf(scene, hit, wo, r.light, r.P, r.lightN));
+			return r;
+		}
+
+		static bool IsVisible(Scene& scene, const ShadingData& hit, const float3 P)
+		{
+			float3 L = P - hit.I;
+			float dist = length(L);
+			L *= 1 / dist;
+			Ray shadowRay(hit.I + L * 0.001f, L, dist - 0.002f, VIS_SHADOW);
+			return !scene.IsOccluded(shadowRay);
+		}
+	};
+}
@@ -0,0 +1,204 @@
+#pragma once
+
+// dimension layout: camera jitter first, then a fixed block per path vertex, so
+// that the same decision always draws from the same dimension
+#define SAMPLER_CAMERA_DIMS	2
+#define SAMPLER_BOUNCE_DIMS	8
+#define BLUE_NOISE_SIZE		64
+// purposes of the per-pixel random streams
+#define STREAM_RESTIR_CANDIDATES	0
+#define STREAM_RESTIR_REUSE		1
+#define STREAM_RADIANCE_CACHE	2
+
+namespace Tmpl8 {
+	enum SamplerType
+	{
+		WhiteNoise,
+		SobolOwen,	// Owen-scrambled Sobol, decorrelated per pixel
+		BlueNoise	// one Sobol sequence for all pixels, rotated per pixel by a blue noise mask
+	};
+
+	class SamplerUtils {
+	public:
+		static uint Hash(uint x)
+		{
+			// lowbias32, https://nullprogram.com/blog/2018/07/31/
+			x ^= x >> 16, x *= 0x7feb352d;
+			x ^= x >> 15, x *= 0x846ca68b;
+			x ^= x >> 16;
+			return x;
+		}
+
+		static uint HashCombine(uint seed, uint v) { return seed ^ (v + 0x9e3779b9 + (seed << 6) + (seed >> 2)); }
+
+		static float ToFloat(uint x) { return (x >> 8) * (1.0f / 16777216.0f); }
+
+		static uint ReverseBits(uint x)
+		{
+			x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+			x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+			x = ((x >> 4) & 0x0f0f0f0f) | ((x & 0x0f0f0f0f) << 4);
+			x = ((x >> 8) & 0x00ff00ff) | ((x & 0x00ff00ff) << 8);
+			return (x >> 16) | (x << 16);
+		}
+
+		// Owen scrambling in base 2: Burley, Practical Hash-based Owen Scrambling (JCGT 2020)
+		static uint NestedUniformScramble(uint x, uint seed)
+		{
+			x = ReverseBits(x);
+			x += seed;
+			x ^= x * 0x6c50b47c;
+			x ^= x * 0xb82f1e52;
+			x ^= x * 0xc7afe638;
+			x ^= x * 0x8d22f6e6;
+			return ReverseBits(x);
+		}
+
+		static const uint* SobolDirections()
+		{
+			// first four Sobol dimensions (Joe and Kuo), 32 bits each
+			static const auto directions = []
+			{
+				static uint v[4][32];
+				const uint s[4] = { 0, 1, 2, 3 }, a[4] = { 0, 0, 1, 1 }, m[4][3] = { {}, { 1 }, { 1, 3 }, { 1, 3, 1 } };
+				for (int i = 0; i < 32; i++) v[0][i] = 1u << (31 - i);
+				for (int d = 1; d < 4; d++)
+				{
+					for (uint i = 0; i < s[d]; i++) v[d][i] = m[d][i] << (31 - i);
+					for (uint i = s[d]; i < 32; i++)
+					{
+						v[d][i] = v[d][i - s[d]] ^ (v[d][i - s[d]] >> s[d]);
+						for (uint k = 1; k < s[d]; k++) v[d][i] ^= ((a[d] >> (s[d] - 1 - k)) & 1) * v[d][i - k];
+					}
+				}
+				return &v[0][0];
+			}();
+			return directions;
+		}
+
+		static uint Sobol(uint index, uint dim)
+		{
+			const uint* v = SobolDirections() + dim * 32;
+			uint x = 0;
+			for (int bit = 0; index; index >>= 1, bit++) if (index & 1) x ^= v[bit];
+			return x;
+		}
+
+		static float ScrambledSobol(uint index, uint dim, uint seed)
+		{
+			// dimensions are padded in sets of four, each set with its own index shuffle
+			uint setSeed = Hash(HashCombine(seed, dim >> 2));
+			uint shuffled = NestedUniformScramble(index, setSeed);
+			return ToFloat(NestedUniformScramble(Sobol(shuffled, dim & 3), Hash(HashCombine(setSeed, dim & 3))));
+		}
+
+		static const float* BlueNoiseMask()
+		{
+			static const vector<float> mask = GenerateBlueNoise(BLUE_NOISE_SIZE);
+			return mask.data();
+		}
+
+		static vector<float> GenerateBlueNoise(const int size)
+		{
+			// void-and-cluster (Ulichney 1993): a gaussian energy per pixel locates the
+			// tightest cluster and the largest void; the order in which pixels are
+			// switched on is the threshold
+			const int n = size * size;
+			vector<float> kernel(n), energy(n, 0), rank(n);
+			vector<char> on(n, 0);
+			for (int y = 0; y < size; y++) for (int x = 0; x < size; x++)
+			{
+				int dx = min(x, size - x), dy = min(y, size - y);
+				kernel[x + y * size] = expf(-(dx * dx + dy * dy) / (2 * 1.5f * 1.5f));
+			}
+			auto toggle = [&](int p, bool value)
+			{
+				on[p] = value;
+				const float sign = value ? 1.0f : -1.0f;
+				int px = p % size, py = p / size;
+				for (int y = 0; y < size; y++) for (int x = 0; x < size; x++)
+					energy[x + y * size] += sign * kernel[((x - px) & (size - 1)) + ((y - py) & (size - 1)) * size];
+			};
+			auto extreme = [&](bool value, bool largest)
+			{
+				int best = -1;
+				for (int p = 0; p < n; p++) if (on[p] == value && (best < 0 || (largest ? energy[p] > energy[best] : energy[p] < energy[best]))) best = p;
+				return best;
+			};
+			// initial pattern: a tenth of the pixels, then relaxed until the tightest
+			// cluster is also the largest void
+			uint seed = 0x12345;
+			int ones = n / 10;
+			for (int i = 0; i < ones; )
+			{
+				int p = RandomUInt(seed) % n;
+				if (!on[p]) toggle(p, true), i++;
+			}
+			while (true)
+			{
+				int cluster = extreme(true, true);
+				toggle(cluster, false);
+				int vacancy = extreme(false, false);
+				toggle(vacancy, true);
+				if (vacancy == cluster) break;
+			}
+			vector<char> initial = on;
+			vector<float> initialEnergy = energy;
+			// phase 1: remove the initial points, tightest cluster first
+			for (int r = ones - 1; r >= 0; r--)
+			{
+				int cluster = extreme(true, true);
+				toggle(cluster, false);
+				rank[cluster] = (float)r;
+			}
+			on = initial, energy = initialEnergy;
+			// phases 2 and 3: fill the largest void until the mask is full
+			for (int r = ones; r < n; r++)
+			{
+				int vacancy = extreme(false, false);
+				toggle(vacancy, true);
+				rank[vacancy] = (float)r;
+			}
+			for (float& value : rank) value = (value + 0.5f) / n;
+			return rank;
+		}
+
+		static float Sample(SamplerType type, int x, int y, uint index, uint dim)
+		{
+			const uint pixel = (uint)(x + y * SCRWIDTH);
+			switch (type)
+			{
+			case SobolOwen:
+				return ScrambledSobol(index, dim, Hash(pixel));
+			case BlueNoise:
+			{
+				// toroidal R2 offset per dimension, so the dimensions do not share a mask
+				const int ox = (int)(dim * 0.7548776662f * BLUE_NOISE_SIZE), oy = (int)(dim * 0.5698402910f * BLUE_NOISE_SIZE);
+				float shift = BlueNoiseMask()[((x + ox) & (BLUE_NOISE_SIZE - 1)) + ((y + oy) & (BLUE_NOISE_SIZE - 1)) * BLUE_NOISE_SIZE];
+				float value = ScrambledSobol(index, dim, 0) + shift;
+				return value < 1 ? value : value - 1;
+			}
+			default:
+				return ToFloat(Hash(HashCombine(HashCombine(Hash(pixel), index), dim)));
+			}
+		}
+	};
+
+	// per-pixel sample stream, keyed by (pixel, sample index, dimension)
+	struct Sampler
+	{
+		Sampler(int x, int y, uint index, SamplerType type = SobolOwen) : x(x), y(y), index(index), type(type) {}
+		float Get(uint dim) const { return SamplerUtils::Sample(type, x, y, index, dim); }
+		float Next() { return Get(dimension++); }
+		// counter-based generator for an open-ended number of draws, seeded by
+		// pixel and sample index: the same on any thread
+		PCG32 Stream(uint purpose) const
+		{
+			const uint pixel = (uint)(x + y * SCRWIDTH);
+			return PCG32(((uint64_t)index << 32) | pixel, SamplerUtils::HashCombine(SamplerUtils::Hash(pixel), purpose));
+		}
+		int x, y;
+		uint index, dimension = 0;
+		SamplerType type;
+	};
+}
@@ -14,6 +14,7 @@
 #include <list>
 #include <string>
 #include <thread>
+#include <atomic>
 #include <math.h>
 #include <algorithm>
 #include <assert.h>
@@ -446,7 +447,36 @@ inline uint RGBF32_to_RGB8( const float4* v )
 #endif
 }
 
+// a float that threads add to without locks; copying is not atomic
+struct AtomicFloat
+{
+	AtomicFloat( float v = 0 ) : value( v ) {}
+	AtomicFloat( const AtomicFloat& other ) : value( other.Load() ) {}
+	AtomicFloat& operator=( const AtomicFloat& other ) { value.store( other.Load(), std::memory_order_relaxed ); return *this; }
+	float Load() const { return value.load( std::memory_order_relaxed ); }
+	void Add( const float v )
+	{
+		float old = value.load( std::memory_order_relaxed );
+		while (!value.compare_exchange_weak( old, old + v, std::memory_order_relaxed ));
+	}
+	std::atomic<float> value;
+};
+
 // random numbers
+// PCG32 (O'Neill 2014): 64-bit state, one independent sequence per stream
+struct PCG32
+{
+	PCG32( const uint64_t seed, const uint64_t stream ) : state( 0 ), inc( (stream << 1) | 1 ) { Next(), state += seed, Next(); }
+	uint Next()
+	{
+		uint64_t old = state;
+		state = old * 6364136223846793005ull + inc;
+		uint xorshifted = (uint)(((old >> 18) ^ old) >> 27), rot = (uint)(old >> 59);
+		return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31));
+	}
+	float NextFloat() { return Next() * 2.3283064365387e-10f; }
+	uint64_t state, inc;
+};
 uint InitSeed( uint seedBase );
 uint RandomUInt();
 uint RandomUInt( uint& seed );
@@ -1649,11 +1679,21 @@ public:
 
 #include "bvh.h"
 #include "ray.h"
+#include "mesh.h"
 #include "primitive.h"
 #include "material.h"
+#include "bsdf.h"
+#include "light.h"
 #include "scene.h"
 #include "camera.h"
+#include "sampler.h"
+#include "restir.h"
+#include "denoiser.h"
+#include "path_guiding.h"
+#include "radiance_cache.h"
+#include "photon_map.h"
 #include "path_trace_module.h"
+#include "wavefront_path_trace_module.h"
 #include "whitted_style_ray_trace_module.h"
 #include "renderer.h"
 
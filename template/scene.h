@@ -18,11 +18,40 @@
 // if you plan to alter the scene in any way.
 // -----------------------------------------------------------
 
+// intersect triangles through precomputed TriAccel records instead of
+// Moller-Trumbore on the primitive; comment out to compare the two.
+#define TRIACCEL
+
+// pack triangles and spheres in BVH leaves into 8-wide bundles that are
+// tested with AVX2; leaves may then hold up to LEAF_SIZE primitives.
+// Bundled triangles are always TriAccel records, whether TRIACCEL is set or not.
+#define SIMD_LEAVES
+#ifdef SIMD_LEAVES
+#define LEAF_SIZE 8
+#else
+#define LEAF_SIZE 2
+#endif
+
 #define PLANE_X(o,i) {if((t=-(ray.O.x+o)*ray.rD.x)<ray.t)ray.t=t,ray.objIdx=i;}
 #define PLANE_Y(o,i) {if((t=-(ray.O.y+o)*ray.rD.y)<ray.t)ray.t=t,ray.objIdx=i;}
 #define PLANE_Z(o,i) {if((t=-(ray.O.z+o)*ray.rD.z)<ray.t)ray.t=t,ray.objIdx=i;}
 
 namespace Tmpl8 {
+// -----------------------------------------------------------
+// Shading record
+// Everything the integrators need at a hit, fetched once after
+// FindNearest with Scene::GetShadingData.
+// -----------------------------------------------------------
+struct ShadingData
+{
+	float3 I;		// hit position
+	float3 N;		// face normal, flipped towards the incoming ray
+	float3 albedo;
+	float2 uv;		// barycentrics for triangles, surface coordinates otherwise
+	const Material* material;
+	int objIdx;		// -1 for a miss
+};
+
 // -----------------------------------------------------------
 // Scene class
 // We intersect this. The query is internally forwarded to the
@@ -36,6 +65,7 @@ public:
 	Scene()
 	{
 		// we store all primitives in one continuous buffer
+		gameObjects.resize(39);
 		gameObjects[0] = PrimitiveFactory::GenerateQuad(0, 1, 1); // 0: light source
 		gameObjects[1] = PrimitiveFactory::GenerateSphere(1, 3, 0.5f); // 1: bouncing ball
 		gameObjects[2] = PrimitiveFactory::GenerateSphere(2, 3, 1);
@@ -46,19 +76,24 @@ public:
 		gameObjects[6] = PrimitiveFactory::GenerateQuad(6, 5, 20, mat4::Translate(0, 4, 0)); // roof
 		gameObjects[7] = PrimitiveFactory::GenerateQuad(7, 5, 20, mat4::Translate(0, 0, -7) * mat4::RotateX(PI / 2)); // back wall
 		gameObjects[8] = PrimitiveFactory::GenerateQuad(8, 5, 20, mat4::Translate(0, 0, 7) * mat4::RotateX(-PI / 2)); // front wall
+		// the room is convex and the light is inside it: neither can block a shadow ray
+		gameObjects[0].visibility = VIS_CAMERA | VIS_BOUNCE | VIS_EMITTER;
+		for (int i = 3; i <= 8; i++) gameObjects[i].visibility = VIS_CAMERA | VIS_BOUNCE;
+		// a local seed: the layout does not depend on the threads that drew before
+		uint seed = 0x12345678;
 		for (int i = 9; i < 9 + 20; i++)
 		{
 			mat4 T = mat4::Translate(float3(
-				RandomFloat() * 10 - 5, RandomFloat() * 3, RandomFloat() * 10 - 5
-			)) * mat4::RotateX(RandomFloat() * PI) * mat4::RotateY(RandomFloat() * PI) * mat4::RotateZ(RandomFloat() * PI);
+				RandomFloat(seed) * 10 - 5, RandomFloat(seed) * 3, RandomFloat(seed) * 10 - 5
+			)) * mat4::RotateX(RandomFloat(seed) * PI) * mat4::RotateY(RandomFloat(seed) * PI) * mat4::RotateZ(RandomFloat(seed) * PI);
 			gameObjects[i] = PrimitiveFactory::GenerateTriangle(i, 2, float3(-0.2f, -0.2f, 0), float3(0, 0.2f, 0), float3(0.5, -0.2f, 0), T);
 		}
 		for (int i = 29; i < 29 + 10; i++)
 		{
 			mat4 T = mat4::Translate(float3(
-				RandomFloat() * 10 - 5, RandomFloat() * 3, RandomFloat() * 10 - 5
+				RandomFloat(seed) * 10 - 5, RandomFloat(seed) * 3, RandomFloat(seed) * 10 - 5
 			));
-			int matIdx = 8 + (int)floor(RandomFloat() * 3.99);
+			int matIdx = 8 + (int)floor(RandomFloat(seed) * 3.99);
 			gameObjects[i] = PrimitiveFactory::GenerateSphere(i, matIdx, 0.2f, T);
 		}
 		SetTime( 0 );
@@ -66,6 +101,7 @@ public:
 		materials[0].color = float3(240 / 255.f, 98 / 255.f, 146 / 255.f);
 		// light material
 		materials[1].isLight = true; // light material
+		materials[1].color = float3(16, 16, 12.4f); // emitted radiance
 		// white material
 		materials[2].color = float3(1);
 		// ball material
@@ -93,11 +129,21 @@ public:
 		// Note: once we have triangle support we should get rid of the class
 		// hierarchy: virtuals reduce performance somewhat.
 
-		for (int i = 0; i < size(gameObjects); i++) gameObjectsIdx[i] = i;
+		// optional asset: the binary file is a cache of the parsed OBJ and its BVH
+		if (FileExists("assets/mesh.bin") || FileExists("assets/mesh.obj"))
+			AddMesh("assets/mesh", 2, mat4::Translate(0, -1, 0));
 
 		BuildBVH();
+		BuildLights();
 	}
 
+	~Scene()
+	{
+		for (Mesh* mesh : meshes) delete mesh;
+	}
+
+	Scene(const Scene&) = delete; // owns its meshes
+
 	void SetTime( float t )
 	{
 		// default time for the scene is simply 0. Updating/ the time per frame 
@@ -117,24 +163,90 @@ public:
 		mat4 M3base = mat4::Translate(float3(-1.4f, -0.5f, 2) );
 		mat4 M3 = M3base * mat4::Translate(0, tm, 0);
 		gameObjects[1].T = M3, gameObjects[1].invT = M3.FastInvertedTransformNoScale();
+		// once built, the BVH, the bundled sphere centers and the light bounds follow the objects
+		if (!bvhNode.empty()) Refit(), UpdateSphereBundles(), BuildLights();
+	}
+
+	void Refit()
+	{
+		// children are allocated after their parent, so a reverse sweep is bottom-up
+		for (int nodeIdx = (int)nodesUsed - 1; nodeIdx >= 0; nodeIdx--)
+		{
+			BVHNode& node = bvhNode[nodeIdx];
+			if (node.primCount > 0) { UpdateNodeBounds(nodeIdx); continue; }
+			const BVHNode& left = bvhNode[node.leftNode], & right = bvhNode[node.leftNode + 1];
+			node.aabbMin = fminf(left.aabbMin, right.aabbMin), node.aabbMax = fmaxf(left.aabbMax, right.aabbMax);
+			node.visibility = left.visibility | right.visibility;
+		}
+	}
+
+	void UpdateSphereBundles()
+	{
+		// sphere bundles hold world-space centers; the radius is fixed
+		for (Sphere8& b : sphereBundles) for (int lane = 0; lane < b.count; lane++)
+		{
+			const float3 pos = TransformPosition(float3(0), gameObjects[b.objIdx[lane]].T);
+			((float*)&b.cx)[lane] = pos.x, ((float*)&b.cy)[lane] = pos.y, ((float*)&b.cz)[lane] = pos.z;
+		}
+	}
+
+	void AddMesh(const char* file, int matIdx, mat4 transform = mat4::Identity())
+	{
+		// loads 'file.bin' if present and not older than 'file.obj', otherwise
+		// parses 'file.obj' and writes 'file.bin'
+		const string bin = string(file) + ".bin", obj = string(file) + ".obj";
+		const bool stale = FileExists(bin.c_str()) && !FileIsNewer(bin.c_str(), obj.c_str());
+		Mesh* mesh = new Mesh();
+		Timer timer;
+		if (stale || !mesh->LoadBinary(bin.c_str()))
+		{
+			delete mesh;
+			mesh = new Mesh();
+			if (!mesh->LoadOBJ(obj.c_str())) { delete mesh; return; }
+			mesh->SaveBinary(bin.c_str());
+		}
+		printf("loaded %s: %u triangles in %.2fs, %.1fMB\n", file, mesh->triCount, timer.elapsed(), mesh->MemoryUsage() / (1024.0f * 1024.0f));
+		meshes.push_back(mesh);
+		int objIdx = (int)gameObjects.size();
+		gameObjects.push_back(PrimitiveFactory::GenerateMesh(objIdx, matIdx, mesh, transform));
+		// placed after construction: the top-level BVH, its leaf packs and the lights are rebuilt
+		if (!bvhNode.empty()) BuildBVH(), BuildLights();
 	}
 
 	void BuildBVH()
 	{
+		uint count = (uint)gameObjects.size();
+		gameObjectsIdx.resize(count);
+		for (uint i = 0; i < count; i++) gameObjectsIdx[i] = i;
+		bvhNode.resize(count * 2 - 1);
+		leafPacks.resize(count * 2 - 1);
+		nodesUsed = 1;
+#ifdef TRIACCEL
+		BuildTriAccels();
+#endif
 		BVHNode& root = bvhNode[rootNodeIdx];
 		root.leftNode = 0;
 		root.firstPrimIdx = 0, root.primCount = size(gameObjects);
 		UpdateNodeBounds(rootNodeIdx);
 		// subdivide recursively
 		Subdivide(rootNodeIdx);
-		
+		PackLeaves();
+
+	}
+
+	void BuildTriAccels()
+	{
+		// triangles are static, so their world-space records are built once
+		triAccels.resize(gameObjects.size());
+		for (int i = 0; i < size(gameObjects); i++)
+			if (PrimitiveTypes::Resolve(gameObjects[i].type) == 0) triAccels[i] = PrimitiveUtils::BuildTriAccel(gameObjects[i]);
 	}
 
 	void Subdivide(uint nodeIdx)
 	{
 		// terminate recursion
 		BVHNode& node = bvhNode[nodeIdx];
-		if (node.primCount <= 2) return;
+		if (node.primCount <= LEAF_SIZE) return;
 
 		// determine split axis using SAH
 		int bestAxis = -1;
@@ -150,7 +262,7 @@ public:
 
 		float3 e = node.aabbMax - node.aabbMin; // extent of parent
 		float parentArea = e.x * e.y + e.y * e.z + e.z * e.x;
-		float parentCost = node.primCount * parentArea;
+		float parentCost = LeafCost(node) * parentArea;
 
 		if (bestCost >= parentCost) return;
 
@@ -186,31 +298,195 @@ public:
 		Subdivide(rightChildIdx);
 	}
 
+	float LeafCost(BVHNode& node)
+	{
+		uint count[3] = { 0, 0, 0 };
+		for (uint i = 0; i < node.primCount; i++)
+			count[CostSlot(gameObjects[gameObjectsIdx[node.firstPrimIdx + i]])]++;
+		return LeafCost(count);
+	}
+
+	// SAH cost slots: triangles, spheres, everything else
+	static int CostSlot(Primitive& p) { return p.type < 2 ? p.type : 2; }
+
+	static float LeafCost(uint count[3])
+	{
+#ifdef SIMD_LEAVES
+		// a bundle of up to eight triangles or spheres costs about one test
+		return (float)((count[0] + 7) / 8 + (count[1] + 7) / 8 + count[2]);
+#else
+		return (float)(count[0] + count[1] + count[2]);
+#endif
+	}
+
+	void PackLeaves()
+	{
+		// group every leaf by primitive type, so that the leaf can be intersected
+		// as a few tight loops over a single kernel each
+		triBundles.clear(), sphereBundles.clear(), leafRest.clear();
+		for (uint nodeIdx = 0; nodeIdx < nodesUsed; nodeIdx++)
+		{
+			BVHNode& node = bvhNode[nodeIdx];
+			if (node.primCount == 0) continue;
+			LeafPack& pack = leafPacks[nodeIdx];
+			pack.firstTriBundle = (uint)triBundles.size(), pack.triBundleCount = 0;
+			pack.firstSphereBundle = (uint)sphereBundles.size(), pack.sphereBundleCount = 0;
+			for (int type = 0; type < MAX_PRIMITIVE_TYPES; type++)
+			{
+				pack.firstRest[type] = (uint)leafRest.size(), pack.restCount[type] = 0;
+				for (uint i = 0; i < node.primCount; i++)
+				{
+					uint primIdx = gameObjectsIdx[node.firstPrimIdx + i];
+					if (PrimitiveTypes::Resolve(gameObjects[primIdx].type) != type) continue;
+#ifdef SIMD_LEAVES
+					if (bundleLeaves && type == 0) { AddToTriBundle(pack, gameObjects[primIdx]); continue; }
+					if (bundleLeaves && type == 1) { AddToSphereBundle(pack, gameObjects[primIdx]); continue; }
+#endif
+					leafRest.push_back(primIdx), pack.restCount[type]++;
+				}
+			}
+		}
+	}
+
+	void AddToTriBundle(LeafPack& pack, Primitive& p)
+	{
+		if (pack.triBundleCount == 0 || triBundles.back().count == 8)
+			triBundles.push_back(TriAccel8{}), pack.triBundleCount++;
+		TriAccel8& b = triBundles.back();
+		TriAccel a = PrimitiveUtils::BuildTriAccel(p);
+		int lane = b.count++;
+		((float*)&b.r0x)[lane] = a.row0.x, ((float*)&b.r0y)[lane] = a.row0.y;
+		((float*)&b.r0z)[lane] = a.row0.z, ((float*)&b.r0w)[lane] = a.row0.w;
+		((float*)&b.r1x)[lane] = a.row1.x, ((float*)&b.r1y)[lane] = a.row1.y;
+		((float*)&b.r1z)[lane] = a.row1.z, ((float*)&b.r1w)[lane] = a.row1.w;
+		((float*)&b.r2x)[lane] = a.row2.x, ((float*)&b.r2y)[lane] = a.row2.y;
+		((float*)&b.r2z)[lane] = a.row2.z, ((float*)&b.r2w)[lane] = a.row2.w;
+		((int*)&b.visibility)[lane] = p.visibility;
+		b.objIdx[lane] = p.objIdx;
+	}
+
+	void AddToSphereBundle(LeafPack& pack, Primitive& p)
+	{
+		if (pack.sphereBundleCount == 0 || sphereBundles.back().count == 8)
+			sphereBundles.push_back(Sphere8{}), pack.sphereBundleCount++;
+		Sphere8& b = sphereBundles.back();
+		// world-space center: SetTime updates it through UpdateSphereBundles
+		float3 pos = TransformPosition(float3(0), p.T);
+		int lane = b.count++;
+		((float*)&b.cx)[lane] = pos.x, ((float*)&b.cy)[lane] = pos.y, ((float*)&b.cz)[lane] = pos.z;
+		((float*)&b.r2)[lane] = p.tri.vertex0.y;
+		((int*)&b.visibility)[lane] = p.visibility;
+		b.objIdx[lane] = p.objIdx;
+	}
+
+	template <class Kernel> void IntersectRange(uint first, uint count, Ray& ray)
+	{
+		for (uint i = 0; i < count; i++)
+		{
+			uint primIdx = leafRest[first + i];
+			if ((gameObjects[primIdx].visibility & ray.mask) == 0) continue;
+#ifdef TRIACCEL
+			if constexpr (Kernel::type == 0)
+			{
+				PrimitiveUtils::IntersectTriAccel(triAccels[primIdx], gameObjects[primIdx].objIdx, ray);
+				continue;
+			}
+#endif
+			Kernel::Intersect(gameObjects[primIdx], ray);
+		}
+	}
+
+	void IntersectLeafPack(const LeafPack& pack, Ray& ray)
+	{
+		for (uint i = 0; i < pack.triBundleCount; i++)
+			PrimitiveUtils::IntersectTriAccel8(triBundles[pack.firstTriBundle + i], ray);
+		for (uint i = 0; i < pack.sphereBundleCount; i++)
+			PrimitiveUtils::IntersectSphere8(sphereBundles[pack.firstSphereBundle + i], ray);
+		PrimitiveTypes::ForEach([&](auto kernel)
+		{
+			typedef decltype(kernel) Kernel;
+			IntersectRange<Kernel>(pack.firstRest[Kernel::type], pack.restCount[Kernel::type], ray);
+		});
+	}
+
+	void IntersectLeaf(BVHNode& node, Ray& ray)
+	{
+		// per-primitive runtime dispatch through the central switch; kept as the benchmark baseline
+		for (uint i = 0; i < node.primCount; i++)
+		{
+			uint primIdx = gameObjectsIdx[node.firstPrimIdx + i];
+			Primitive& p = gameObjects[primIdx];
+			if ((p.visibility & ray.mask) == 0) continue;
+#ifdef TRIACCEL
+			if (PrimitiveTypes::Resolve(p.type) == 0)
+			{
+				PrimitiveUtils::IntersectTriAccel(triAccels[primIdx], p.objIdx, ray);
+				continue;
+			}
+#endif
+			PrimitiveUtils::IntersectSwitch(p, ray);
+		}
+	}
+
+	void BenchmarkDispatch(int rayCount = 1 << 20)
+	{
+		// random rays from inside the room, traced with both leaf dispatch modes;
+		// bundled triangles and spheres would skip either dispatch, so leaves are
+		// repacked without bundles for the measurement
+		vector<Ray> rays(rayCount);
+		uint seed = 0x12345678;
+		for (int i = 0; i < rayCount; i++)
+		{
+			float3 O(RandomFloat(seed) * 10 - 5, RandomFloat(seed) * 4 - 0.5f, RandomFloat(seed) * 10 - 5);
+			float3 D = normalize(float3(RandomFloat(seed) - 0.5f, RandomFloat(seed) - 0.5f, RandomFloat(seed) - 0.5f));
+			rays[i] = Ray(O, D);
+		}
+		const bool bundled = bundleLeaves;
+		bundleLeaves = false, PackLeaves();
+		for (int mode = 0; mode < 2; mode++)
+		{
+			perPrimitiveDispatch = mode == 0;
+			float checksum = 0;
+			Timer timer;
+			for (int i = 0; i < rayCount; i++)
+			{
+				Ray ray = rays[i];
+				FindNearest(ray);
+				checksum += ray.objIdx;
+			}
+			float ms = timer.elapsed() * 1000;
+			printf("%s: %.2fms (%.1fMrays/s), checksum %.0f\n", perPrimitiveDispatch ? "per-primitive switch" : "per-type leaf ranges",
+				ms, rayCount / (ms * 1000), checksum);
+		}
+		perPrimitiveDispatch = false;
+		bundleLeaves = bundled, PackLeaves();
+	}
+
 	float EvaluateSAH(BVHNode& node, int axis, float pos)
 	{
 		// determine triangle counts and bounds for this split candidate
 		AABB leftBox, rightBox;
-		int leftCount = 0, rightCount = 0;
+		uint leftCount[3] = { 0, 0, 0 }, rightCount[3] = { 0, 0, 0 };
 		for (uint i = 0; i < node.primCount; i++)
 		{
 			Primitive& primitive = gameObjects[gameObjectsIdx[node.firstPrimIdx + i]];
 			float3 candidatePos = TransformPosition(float3(0), primitive.T);
 			if (candidatePos.cell[axis] < pos)
 			{
-				leftCount++;
+				leftCount[CostSlot(primitive)]++;
 				AABB bounds = PrimitiveUtils::GetBounds(primitive);
 				leftBox.grow(bounds.bmin);
 				leftBox.grow(bounds.bmax);
 			}
 			else
 			{
-				rightCount++;
+				rightCount[CostSlot(primitive)]++;
 				AABB bounds = PrimitiveUtils::GetBounds(primitive);
 				rightBox.grow(bounds.bmin);
 				rightBox.grow(bounds.bmax);
 			}
 		}
-		float cost = leftCount * leftBox.area() + rightCount * rightBox.area();
+		float cost = LeafCost(leftCount) * leftBox.area() + LeafCost(rightCount) * rightBox.area();
 		return cost > 0 ? cost : 1e30f;
 	}
 
@@ -219,10 +495,12 @@ public:
 		BVHNode& node = bvhNode[nodeIdx];
 		node.aabbMin = float3(1e30f);
 		node.aabbMax = float3(-1e30f);
+		node.visibility = 0;
 		for (uint first = node.firstPrimIdx, i = 0; i < node.primCount; i++)
 		{
 			uint leafTriIdx = gameObjectsIdx[first + i];
 			Primitive& leafPrim = gameObjects[leafTriIdx];
+			node.visibility |= leafPrim.visibility;
 			AABB bounds = PrimitiveUtils::GetBounds(leafPrim);
 			node.aabbMin = fminf(node.aabbMin, bounds.bmin);
 			node.aabbMax = fmaxf(node.aabbMax, bounds.bmax);
@@ -244,42 +522,75 @@ public:
 
 	bool IsOccluded(Ray& ray)
 	{
-		float rayLength = ray.t;
-		
-		/*
-		for (int i = 0; i < size(gameObjects); i++)
-		{
-			PrimitiveUtils::Intersect(gameObjects[i], ray);
-		}*/
-		
-		IntersectBVH(ray, rootNodeIdx, true);
-		return ray.t < rayLength;
+		// any hit closer than ray.t occludes; only shadow casters are visited
+		uint mask = ray.mask;
+		ray.mask = VIS_SHADOW;
+		bool occluded = IntersectBVH(ray, rootNodeIdx, true);
+		ray.mask = mask;
+		return occluded;
 	}
 
-	void IntersectBVH(Ray& ray, const uint nodeIdx, bool shadowRay = false)
+	void IsOccluded(Ray* rays, const int count, bool* occluded)
 	{
-		BVHNode& node = bvhNode[nodeIdx];
-		if (!IntersectAABB(ray, node.aabbMin, node.aabbMax)) return;
-		if (node.primCount > 0)
+		// a packet of shadow rays that end close together, e.g. at one light: the
+		// BVH is walked once for all of them. The segments lie in the box around
+		// their ends, so a node outside it is skipped for the whole packet. Inside,
+		// rays are tested from the first one that entered the parent node: the
+		// ones before it missed the parent, and so its children too
+		AABB hull;
+		int open = count;
+		for (int i = 0; i < count; i++)
 		{
-			if (shadowRay) 
-			{
-				ray.t = 0;  
-				return;
-			}
-
-			for (uint i = 0; i < node.primCount; i++)
+			occluded[i] = false;
+			hull.grow(rays[i].O), hull.grow(rays[i].O + rays[i].D * rays[i].t);
+			rays[i].mask = VIS_SHADOW;
+		}
+		uint stack[128], firstRay[128], stackPtr = 0;
+		stack[stackPtr] = rootNodeIdx, firstRay[stackPtr++] = 0;
+		while (stackPtr > 0 && open > 0)
+		{
+			stackPtr--;
+			const uint nodeIdx = stack[stackPtr];
+			BVHNode& node = bvhNode[nodeIdx];
+			if ((node.visibility & VIS_SHADOW) == 0) continue;
+			if (node.aabbMin.x > hull.bmax.x || node.aabbMin.y > hull.bmax.y || node.aabbMin.z > hull.bmax.z ||
+				node.aabbMax.x < hull.bmin.x || node.aabbMax.y < hull.bmin.y || node.aabbMax.z < hull.bmin.z) continue;
+			int first = firstRay[stackPtr];
+			while (first < count && (occluded[first] || !IntersectAABB(rays[first], node.aabbMin, node.aabbMax))) first++;
+			if (first == count) continue;
+			if (node.primCount > 0)
 			{
-				Primitive& p = gameObjects[gameObjectsIdx[node.firstPrimIdx + i]];
-				PrimitiveUtils::Intersect(p, ray);
+				for (int i = first; i < count; i++)
+				{
+					if (occluded[i] || (i > first && !IntersectAABB(rays[i], node.aabbMin, node.aabbMax))) continue;
+					const float t = rays[i].t;
+					if (perPrimitiveDispatch) IntersectLeaf(node, rays[i]);
+					else IntersectLeafPack(leafPacks[nodeIdx], rays[i]);
+					if (rays[i].t < t) occluded[i] = true, open--;
+				}
+				continue;
 			}
+			if (node.leftNode == 0) continue;
+			stack[stackPtr] = node.leftNode + 1, firstRay[stackPtr++] = first;
+			stack[stackPtr] = node.leftNode, firstRay[stackPtr++] = first;
 		}
-		else
+	}
+
+	bool IntersectBVH(Ray& ray, const uint nodeIdx, bool shadowRay = false)
+	{
+		// returns true when a shadow ray found a hit and traversal can stop
+		BVHNode& node = bvhNode[nodeIdx];
+		if ((node.visibility & ray.mask) == 0) return false;
+		if (!IntersectAABB(ray, node.aabbMin, node.aabbMax)) return false;
+		if (node.primCount > 0)
 		{
-			if (node.leftNode == 0) return;
-			IntersectBVH(ray, node.leftNode);
-			IntersectBVH(ray, node.leftNode + 1);
+			float t = ray.t;
+			if (perPrimitiveDispatch) IntersectLeaf(node, ray);
+			else IntersectLeafPack(leafPacks[nodeIdx], ray);
+			return shadowRay && ray.t < t;
 		}
+		if (node.leftNode == 0) return false;
+		return IntersectBVH(ray, node.leftNode, shadowRay) || IntersectBVH(ray, node.leftNode + 1, shadowRay);
 	}
 
 	bool IntersectAABB(const Ray& ray, const float3 bmin, const float3 bmax)
@@ -293,38 +604,96 @@ public:
 		return tmax >= tmin && tmin < ray.t&& tmax > 0;
 	}
 
-	void IntersectLight(Ray& ray)
+	void BuildLights()
+	{
+		// every primitive with an emissive material is a light
+		lights.clear();
+		objectLight.assign( gameObjects.size(), -1 );
+		vector<float> power;
+		for (Primitive& p : gameObjects)
+		{
+			const Material& material = materials[p.matIdx];
+			if (!material.isLight || !LightUtils::CanSample( p )) continue;
+			Light light;
+			light.objIdx = p.objIdx;
+			light.emission = material.color;
+			light.area = LightUtils::Area( p );
+			light.power = dot( light.emission, float3( 0.2126f, 0.7152f, 0.0722f ) ) * light.area;
+			light.bounds = PrimitiveUtils::GetBounds( p );
+			light.center = (light.bounds.bmin + light.bounds.bmax) * 0.5f;
+			objectLight[p.objIdx] = (int)lights.size();
+			lights.push_back( light );
+			power.push_back( light.power );
+		}
+		lightTable.Build( power );
+		lightTree.Build( lights );
+	}
+
+	int PickLight( const float3 I, const float3 N, const float r, float& pmf ) const
+	{
+		// returns -1 when no light can reach the surface
+		if (lights.empty()) return -1;
+		if (useLightTree) return lightTree.Sample( I, N, r, pmf );
+		int light = lightTable.Sample( r );
+		pmf = lightTable.pmf[light];
+		return light;
+	}
+
+	float LightPmf( const float3 I, const float3 N, const int light ) const
 	{
-		PrimitiveUtils::Intersect(gameObjects[0], ray);
+		return useLightTree ? lightTree.Pmf( I, N, lights[light] ) : lightTable.pmf[light];
 	}
 
-	float3 GetLightPos() const
+	void SamplePointOnLight( const int light, const float r0, const float r1, float3& P, float3& N ) const
 	{
-		// light point position is the middle of the swinging quad
-		float3 corner1 = TransformPosition( float3( -0.5f, 0, -0.5f ), gameObjects[0].T);
-		float3 corner2 = TransformPosition( float3( 0.5f, 0, 0.5f ), gameObjects[0].T );
-		return (corner1 + corner2) * 0.5f - float3( 0, 0.01f, 0 );
+		LightUtils::SamplePoint( gameObjects[lights[light].objIdx], r0, r1, P, N );
 	}
 
-	float3 GetRandomPointOnLight() const
+	float LightPdf( const Ray& ray, const float3 lightN, const float3 I, const float3 N ) const
 	{
-		float randX = Rand(1.0f) - 0.5f;
-		float randY = Rand(1.0f) - 0.5f;
-		return TransformPosition(float3(randX, 0, randY), gameObjects[0].T) - float3(0, 0.01f, 0);
+		// solid angle density of light sampling from (I, N), for a ray that hit
+		// an emitter; lights emit on both sides
+		int light = objectLight[ray.objIdx];
+		if (light < 0) return 0;
+		float cosO = fabs( dot( lightN, ray.D ) );
+		return LightPmf( I, N, light ) * ray.t * ray.t / (cosO * lights[light].area);
 	}
 
-	float3 GetLightColor() const
+	void IntersectLight( Ray& ray, const int light )
 	{
-		return float3( 16, 16, 12.4 );
+		PrimitiveUtils::Intersect( gameObjects[lights[light].objIdx], ray );
+	}
+
+	float3 GetLightPos( const int light ) const
+	{
+		return TransformPosition( float3( 0 ), gameObjects[lights[light].objIdx].T );
+	}
+
+	void GetShadingData( const Ray& ray, ShadingData& hit, const bool withAlbedo = true )
+	{
+		// one primitive and one material lookup per hit; without albedo, the
+		// caller resolves it, e.g. for a batch of hits of one material
+		Primitive& p = gameObjects[ray.objIdx];
+		hit.objIdx = ray.objIdx;
+		hit.I = ray.O + ray.t * ray.D;
+		hit.material = &materials[p.matIdx];
+		PrimitiveTypes::Visit( p.type, [&]( auto kernel )
+		{
+			typedef decltype(kernel) Kernel;
+			hit.N = Kernel::GetNormal( p, hit.I, ray.primIdx );
+			hit.uv = Kernel::GetUV( p, hit.I, ray );
+		} );
+		if (dot( hit.N, ray.D ) > 0) hit.N = -hit.N; // hit backside / inside
+		if (withAlbedo) hit.albedo = MaterialUtils::GetAlbedo( *hit.material, hit.I, hit.uv );
 	}
 
-	float3 GetNormal( int objIdx, float3 I, float3 wo )
+	float3 GetNormal( int objIdx, float3 I, float3 wo, int primIdx = -1 )
 	{
 		// we get the normal after finding the nearest intersection:
 		// this way we prevent calculating it multiple times.
 		
 		if (objIdx == -1) return float3(0);
-		float3 N = PrimitiveUtils::GetNormal(gameObjects[objIdx], I);
+		float3 N = PrimitiveUtils::GetNormal(gameObjects[objIdx], I, primIdx);
 		if (dot( N, wo ) > 0) N = -N; // hit backside / inside
 		return N;
 	}
@@ -344,15 +713,27 @@ public:
 		mat = materials[matIdx];
 
 		return MaterialUtils::GetAlbedo(mat, I);
-		// once we have triangle support, we should pass objIdx and the bary-
-		// centric coordinates of the hit, instead of the intersection location.
+		// for barycentrics / texture coordinates, use GetShadingData instead.
 	}
 	__declspec(align(64)) // start a new cacheline here
 	float animTime = 0;
-	Primitive gameObjects[39];
+	vector<Primitive> gameObjects;
+	vector<Mesh*> meshes;
 	Material materials[12];
-	BVHNode bvhNode[39 * 2 -1];
-	uint gameObjectsIdx[39];
+	vector<BVHNode> bvhNode;
+	vector<uint> gameObjectsIdx;
+	vector<TriAccel> triAccels;
+	vector<LeafPack> leafPacks;
+	vector<TriAccel8> triBundles;
+	vector<Sphere8> sphereBundles;
+	vector<uint> leafRest;
+	vector<Light> lights;
+	vector<int> objectLight; // light index per primitive, -1 if it is not in the registry
+	AliasTable lightTable;
+	LightTree lightTree;
+	bool useLightTree = true; // light selection: spatial light BVH, or the power-based alias table
+	bool perPrimitiveDispatch = false;
+	bool bundleLeaves = true; // with SIMD_LEAVES: pack triangles and spheres into bundles; takes effect in PackLeaves
 	uint rootNodeIdx = 0, nodesUsed = 1;
 };
 
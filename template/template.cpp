@@ -2,6 +2,9 @@
 // IGAD/NHTV/UU - Jacco Bikker - 2006-2022
 
 #include "precomp.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #define STBI_NO_PSD
@@ -668,8 +671,21 @@ void Shader::SetUInt(const char* name, const uint v)
 	CheckGL();
 }
 
-// RNG - Marsaglia's xor32
-static uint seed = 0x12345678;
+// RNG - PCG32 with per-thread state: OpenMP threads neither race on a shared
+// seed nor share its cache line. The sequence is picked by the OpenMP thread
+// number at the thread's first draw; threads outside a parallel region, like
+// the main thread, get sequence 0. Which pixels a thread draws for still
+// depends on the schedule, so code that needs a fixed layout regardless of
+// threads uses a local seed instead.
+static uint RandomStream()
+{
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+static thread_local PCG32 rng( 0x853c49e6748fea9bull, RandomStream() );
 uint WangHash( uint s ) 
 { 
 	s = (s ^ 61) ^ (s >> 16);
@@ -682,16 +698,10 @@ uint InitSeed( uint seedBase )
 {
 	return WangHash( (seedBase + 1) * 17 );
 }
-uint RandomUInt()
-{
-	seed ^= seed << 13;
-	seed ^= seed >> 17;
-	seed ^= seed << 5;
-	return seed;
-}
+uint RandomUInt() { return rng.Next(); }
 float RandomFloat() { return RandomUInt() * 2.3283064365387e-10f; }
 float Rand(float range) { return RandomFloat() * range; }
-// local seed
+// local seed - Marsaglia's xor32
 uint RandomUInt(uint& seed)
 {
 	seed ^= seed << 13;
@@ -0,0 +1,335 @@
+#pragma once
+
+// wavefront path tracer: the same paths as PathTraceModule (NEE with MIS,
+// Lambertian bounces, glass and mirrors, russian roulette), but each stage runs
+// over a whole batch of paths before the next stage starts, so that a thread
+// stays in one small loop (Laine et al., Megakernels Considered Harmful, 2013)
+#define WAVEFRONT_BATCH		(1 << 18)	// paths in flight
+#define WAVEFRONT_STAGES	6
+#define WAVEFRONT_SORT_BLOCKS	64	// independent histograms per radix sort pass
+
+enum WavefrontStage
+{
+	StageGenerate,		// primary rays
+	StageExtend,		// nearest hits for all queued rays
+	StageSort,			// hits grouped by material, then by primitive
+	StageShade,			// one kernel per kind of material
+	StageConnect,		// shadow rays for the light samples
+	StageAccumulate		// finished paths to the output
+};
+
+// indices of paths, appended to from many threads
+struct PathQueue
+{
+	void Reset(const int capacity) { items.resize(capacity), size = 0; }
+	void Push(const int path)
+	{
+		int slot;
+		#pragma omp atomic capture
+		slot = size++;
+		items[slot] = path;
+	}
+	vector<int> items;
+	int size = 0;
+};
+
+struct WavefrontPath
+{
+	float3 throughput, radiance;
+	float3 lastI, lastN;	// the last diffuse vertex, for the light selection pmf
+	float bsdfPdf;			// density of the last diffuse bounce; 0 after camera rays and specular bounces
+	int depth;				// the vertex the current ray leads to
+};
+
+// a light sample of a diffuse vertex, added to the path unless the ray is blocked
+struct ShadowQuery
+{
+	float3 O, D, contribution;
+	float dist;
+	int path;
+};
+
+class WavefrontPathTraceModule
+{
+public:
+	void Init(Scene& scene)
+	{
+		this->scene = &scene;
+		paths.resize(WAVEFRONT_BATCH), rays.resize(WAVEFRONT_BATCH), hits.resize(WAVEFRONT_BATCH), samplers.resize(WAVEFRONT_BATCH, Sampler(0, 0, 0));
+		shadowQueries.resize(WAVEFRONT_BATCH);
+		keys.resize(WAVEFRONT_BATCH), sortedKeys.resize(WAVEFRONT_BATCH), sortedItems.resize(WAVEFRONT_BATCH);
+		isInitialized = true;
+	}
+
+	void ResetStats()
+	{
+		for (float& time : stageTime) time = 0;
+		extensions = 0;
+	}
+
+	// sampleCount paths per sampler, which share its camera ray; result and
+	// primary hit per sampler, in the same order
+	void Render(Camera& camera, const vector<Sampler>& input, const bool jitter, vector<float3>& result, vector<int>& primaryObjIdx)
+	{
+		const int total = (int)input.size(), batch = max(1, WAVEFRONT_BATCH / sampleCount);
+		result.resize(total), primaryObjIdx.resize(total);
+		for (int first = 0; first < total; first += batch)
+		{
+			const int count = min(total - first, batch);
+			Timer t;
+			GeneratePaths(camera, &input[first], count, jitter);
+			stageTime[StageGenerate] += t.elapsed() * 1000;
+			for (int depth = 1; extend.size > 0; depth++)
+			{
+				extensions += extend.size;
+				t.reset(), ExtendPaths(depth == 1 ? sampleCount : 1), stageTime[StageExtend] += t.elapsed() * 1000;
+				if (depth == 1) for (int i = 0; i < count; i++) primaryObjIdx[first + i] = rays[i * sampleCount].objIdx;
+				t.reset();
+				if (sortByMaterial) SortHits();
+				stageTime[StageSort] += t.elapsed() * 1000;
+				t.reset(), ShadePaths(), stageTime[StageShade] += t.elapsed() * 1000;
+				t.reset(), ConnectPaths(), stageTime[StageConnect] += t.elapsed() * 1000;
+				std::swap(extend, next);
+			}
+			t.reset();
+			// same scale as PathTraceModule::Trace
+			#pragma omp parallel for schedule(static)
+			for (int i = 0; i < count; i++)
+			{
+				float3 sum(0);
+				for (int j = 0; j < sampleCount; j++) sum += paths[i * sampleCount + j].radiance;
+				result[first + i] = sum * (1.0f / sampleCount);
+			}
+			stageTime[StageAccumulate] += t.elapsed() * 1000;
+		}
+	}
+
+	void GeneratePaths(Camera& camera, const Sampler* input, const int count, const bool jitter)
+	{
+		// one camera ray per sampler, for the first of its paths
+		extend.Reset(count * sampleCount), next.Reset(count * sampleCount);
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < count; i++)
+		{
+			Sampler sampler = input[i];
+			const int p = i * sampleCount;
+			rays[p] = jitter ? camera.GetPrimaryRay(sampler.x + sampler.Next() - 0.5f, sampler.y + sampler.Next() - 0.5f) : camera.GetPrimaryRay(sampler.x, sampler.y);
+			for (int j = 0; j < sampleCount; j++)
+			{
+				// each path is its own sample index, as in PathTraceModule::Trace
+				samplers[p + j] = sampler;
+				samplers[p + j].index = sampler.index * sampleCount + j;
+				paths[p + j] = { float3(1), float3(0), float3(0), float3(0), 0, 1 };
+			}
+			extend.items[i] = p;
+		}
+		extend.size = count;
+	}
+
+	void ExtendPaths(const int copies)
+	{
+		// the queue is one stream of rays; misses leave it here. The hit of a
+		// shared camera ray also goes to the copies - 1 paths that follow
+		hitQueue.Reset(extend.size * copies);
+		#pragma omp parallel for schedule(dynamic, 256)
+		for (int i = 0; i < extend.size; i++)
+		{
+			const int p = extend.items[i];
+			scene->FindNearest(rays[p]);
+			if (rays[p].objIdx == -1) continue; // or a fancy sky color
+			for (int j = 0; j < copies; j++)
+			{
+				if (j > 0) rays[p + j] = rays[p];
+				hitQueue.Push(p + j);
+			}
+		}
+	}
+
+	void SortHits()
+	{
+		// LSD radix sort, eight bits per pass; every pass is stable, so the
+		// material digits, sorted last, keep the primitive order within a material
+		const int count = hitQueue.size, objects = (int)scene->gameObjects.size();
+		int objectBits = 0, keyBits = 0;
+		while ((1 << objectBits) < objects) objectBits++;
+		while ((1 << keyBits) < (int)(sizeof(scene->materials) / sizeof(Material)) << objectBits) keyBits++;
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < count; i++)
+		{
+			const int objIdx = rays[hitQueue.items[i]].objIdx;
+			keys[i] = (uint)scene->gameObjects[objIdx].matIdx << objectBits | objIdx;
+		}
+		vector<int>& items = hitQueue.items;
+		sortedItems.resize(items.size());
+		for (int shift = 0; shift < keyBits; shift += 8)
+		{
+			// a histogram per block, then one offset per digit and block
+			uint offset[WAVEFRONT_SORT_BLOCKS][256] = {};
+			#pragma omp parallel for schedule(static)
+			for (int block = 0; block < WAVEFRONT_SORT_BLOCKS; block++)
+				for (int i = count * block / WAVEFRONT_SORT_BLOCKS; i < count * (block + 1) / WAVEFRONT_SORT_BLOCKS; i++) offset[block][(keys[i] >> shift) & 255]++;
+			for (uint digit = 0, sum = 0; digit < 256; digit++) for (int block = 0; block < WAVEFRONT_SORT_BLOCKS; block++)
+			{
+				const uint blockCount = offset[block][digit];
+				offset[block][digit] = sum, sum += blockCount;
+			}
+			#pragma omp parallel for schedule(static)
+			for (int block = 0; block < WAVEFRONT_SORT_BLOCKS; block++)
+				for (int i = count * block / WAVEFRONT_SORT_BLOCKS; i < count * (block + 1) / WAVEFRONT_SORT_BLOCKS; i++)
+				{
+					const uint slot = offset[block][(keys[i] >> shift) & 255]++;
+					sortedKeys[slot] = keys[i], sortedItems[slot] = items[i];
+				}
+			std::swap(keys, sortedKeys), std::swap(items, sortedItems);
+		}
+	}
+
+	void ResolveHits(const int first, const int count)
+	{
+		// shading data for up to eight consecutive hits; eight hits of one
+		// procedural material get their albedo in one go
+		const int* items = &hitQueue.items[first];
+		for (int i = 0; i < count; i++) scene->GetShadingData(rays[items[i]], hits[items[i]], false);
+		const Material& material = *hits[items[0]].material;
+		bool uniform = count == 8;
+		for (int i = 1; i < count; i++) uniform &= hits[items[i]].material == &material;
+#ifdef MATERIAL_SIMD
+		if (uniform && (material.solverId == 1 || material.solverId == 2))
+		{
+			float x[8], y[8], z[8], r[8], g[8], b[8];
+			for (int i = 0; i < 8; i++) x[i] = hits[items[i]].I.x, y[i] = hits[items[i]].I.y, z[i] = hits[items[i]].I.z;
+			if (material.solverId == 1) MaterialUtils::SolveFloorMaterial8(material, x, z, r, g, b);
+			else MaterialUtils::SolveBackWallMaterial8(material, x, y, r, g, b);
+			for (int i = 0; i < 8; i++) hits[items[i]].albedo = float3(r[i], g[i], b[i]);
+		}
+		else
+#endif
+		for (int i = 0; i < count; i++) hits[items[i]].albedo = MaterialUtils::GetAlbedo(*hits[items[i]].material, hits[items[i]].I, hits[items[i]].uv);
+		for (int i = 0; i < count; i++)
+		{
+			const Material& m = *hits[items[i]].material;
+			(m.isLight ? lightQueue : m.isMirror || m.isGlass ? specularQueue : diffuseQueue).Push(items[i]);
+		}
+	}
+
+	void ShadePaths()
+	{
+		next.size = 0, shadowCount = 0;
+		for (PathQueue* queue : { &lightQueue, &specularQueue, &diffuseQueue }) queue->Reset(hitQueue.size);
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < hitQueue.size; i += 8) ResolveHits(i, min(8, hitQueue.size - i));
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < lightQueue.size; i++)
+		{
+			const int p = lightQueue.items[i];
+			WavefrontPath& path = paths[p];
+			const float weight = !useNEE || path.bsdfPdf == 0 ? 1 : PathTraceModule::PowerHeuristic(path.bsdfPdf, scene->LightPdf(rays[p], hits[p].N, path.lastI, path.lastN));
+			path.radiance += path.throughput * hits[p].material->color * weight;
+		}
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < specularQueue.size; i++)
+		{
+			const int p = specularQueue.items[i];
+			const ShadingData& hit = hits[p];
+			float3 direction;
+			BSDFUtils::SampleSpecular(*hit.material, hit.N, rays[p].D, samplers[p].Get(Dim(paths[p].depth)), direction);
+			paths[p].throughput *= hit.albedo, paths[p].bsdfPdf = 0;
+			rays[p] = Ray(hit.I + direction * 0.001f, direction);
+			Continue(p);
+		}
+		#pragma omp parallel for schedule(static)
+		for (int i = 0; i < diffuseQueue.size; i++) ShadeDiffuse(diffuseQueue.items[i]);
+	}
+
+	void ShadeDiffuse(const int p)
+	{
+		WavefrontPath& path = paths[p];
+		const ShadingData& hit = hits[p];
+		const Sampler& sampler = samplers[p];
+		const uint dim = Dim(path.depth);
+		const float3 I = hit.I, N = hit.N, wo = -rays[p].D;
+		// the last vertex skips light sampling: a bounce from it would be cut off as well
+		if (useNEE && path.depth < depthLimit) QueueLightSample(p, dim + 3);
+		const BSDFSample bsdf = BSDFUtils::Sample(*hit.material, N, wo, hit.albedo, sampler.Get(dim + 1), sampler.Get(dim + 2));
+		const float cosWi = dot(N, bsdf.wi);
+		if (bsdf.pdf <= 0 || cosWi <= 0) return;
+		path.throughput *= bsdf.f * (cosWi / bsdf.pdf);
+		path.bsdfPdf = bsdf.pdf, path.lastI = I, path.lastN = N;
+		rays[p] = Ray(I + bsdf.wi * 0.001f, bsdf.wi);
+		Continue(p);
+	}
+
+	void QueueLightSample(const int p, const uint dim)
+	{
+		// as PathTraceModule::SampleLight, with the shadow ray left to the connect stage
+		const ShadingData& hit = hits[p];
+		const Sampler& sampler = samplers[p];
+		float pmf;
+		const int light = scene->PickLight(hit.I, hit.N, sampler.Get(dim), pmf);
+		if (light < 0) return;
+		float3 P, lightN;
+		scene->SamplePointOnLight(light, sampler.Get(dim + 1), sampler.Get(dim + 2), P, lightN);
+		float3 L = P - hit.I;
+		const float dist2 = dot(L, L), dist = sqrtf(dist2);
+		L /= dist;
+		const float cosI = dot(hit.N, L), cosO = fabs(dot(lightN, L));
+		if (cosI <= 0 || cosO <= 0) return;
+		const float lightPdf = pmf * dist2 / (cosO * scene->lights[light].area);
+		const float bsdfPdf = BSDFUtils::Pdf(*hit.material, hit.N, -rays[p].D, L);
+		const float3 f = BSDFUtils::Eval(*hit.material, hit.N, -rays[p].D, L, hit.albedo);
+		const float3 contribution = paths[p].throughput * scene->lights[light].emission * f * (cosI * PathTraceModule::PowerHeuristic(lightPdf, bsdfPdf) / lightPdf);
+		int slot;
+		#pragma omp atomic capture
+		slot = shadowCount++;
+		shadowQueries[slot] = { hit.I + L * 0.001f, L, contribution, dist - 0.002f, p };
+	}
+
+	void ConnectPaths()
+	{
+		// a path has at most one query per iteration, so no two threads add to the same path
+		#pragma omp parallel for schedule(dynamic, 256)
+		for (int i = 0; i < shadowCount; i++)
+		{
+			const ShadowQuery& query = shadowQueries[i];
+			Ray shadowRay(query.O, query.D, query.dist, VIS_SHADOW);
+			if (!scene->IsOccluded(shadowRay)) paths[query.path].radiance += query.contribution;
+		}
+	}
+
+	void Continue(const int p)
+	{
+		// russian roulette, then the ray joins the next extension
+		WavefrontPath& path = paths[p];
+		if (path.depth >= russianRouletteDepth)
+		{
+			const float3 t = path.throughput;
+			const float survival = min(0.95f, max(t.x, max(t.y, t.z)));
+			if (samplers[p].Get(Dim(path.depth) + 6) >= survival) return;
+			path.throughput *= 1 / survival;
+		}
+		if (++path.depth > depthLimit) return;
+		next.Push(p);
+	}
+
+	// fixed dimensions per vertex, as in PathTraceModule: 0 glass, 1-2 BSDF, 3-5 light, 6 russian roulette
+	static uint Dim(const int depth) { return SAMPLER_CAMERA_DIMS + (depth - 1) * SAMPLER_BOUNCE_DIMS; }
+
+	vector<WavefrontPath> paths;
+	vector<Ray> rays;
+	vector<ShadingData> hits;
+	vector<Sampler> samplers;
+	vector<ShadowQuery> shadowQueries;
+	PathQueue extend, next, hitQueue, lightQueue, specularQueue, diffuseQueue;
+	vector<uint> keys, sortedKeys;
+	vector<int> sortedItems;
+	int shadowCount = 0;
+	float stageTime[WAVEFRONT_STAGES] = {};	// ms since ResetStats
+	int extensions = 0;						// rays traced by the extend stage
+	int depthLimit = 16;
+	int russianRouletteDepth = 3;
+	int sampleCount = 1;					// paths per sampler; the renderer passes the path tracer's settings
+	bool useNEE = true;
+	bool sortByMaterial = false;			// shade hits grouped by material instead of in pixel order
+	bool isInitialized = false;
+	Scene* scene = 0;
+};
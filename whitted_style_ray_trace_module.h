@@ -1,21 +1,78 @@
 #pragma once
+#define WHITTED_STACK_SIZE	64	// pending branches; depth first, so about one per level
+#define WHITTED_PACKET_SIZE	64	// shadow rays that traverse the BVH together
+
+// a reflection or refraction ray still to trace, and the weight of its result
+// in the pixel: the Fresnel factors, albedos and reflectivities along the way
+struct WhittedBranch
+{
+	float3 O, D, weight;
+	int depth;
+};
+
+// a light sample whose shadow ray is traced later; slot is the sample it adds to
+struct WhittedShadowQuery
+{
+	float3 O, D, contribution;
+	float dist;
+	int slot, light;
+};
+
+// the samples of a tile, with their shadow rays deferred: Trace queues each
+// light sample under the index the sample will get in samples, which the
+// caller appends once Trace returns; ResolveShadows then adds the unblocked light
+struct WhittedShadowBatch
+{
+	vector<WhittedShadowQuery> queries;
+	vector<float3> samples;
+	vector<int> pixels;
+};
+
 class WhittedStyleRayTraceModule
 {
 public:
 	void Init(Scene& scene)
 	{
-		scene = scene;
+		this->scene = &scene;
 		isInitialized = true;
 	}
 
-	float3 Trace(Ray& ray, int depth)
+	float3 Trace(Ray& ray, int depth, const Sampler& sampler, WhittedShadowBatch* shadows = 0)
 	{
-		scene.FindNearest(ray);
+		// the ray tree, depth first from an explicit stack; the primary ray is
+		// traced in place, so the caller sees its hit
+		WhittedBranch stack[WHITTED_STACK_SIZE];
+		int top = 0;
+		float3 result(0), weight(1);
+		Ray* current = &ray;
+		Ray branch;
+		while (true)
+		{
+			result += weight * Shade(*current, depth, weight, sampler, stack, top, shadows);
+			if (top == 0) return result;
+			top--, branch = Ray(stack[top].O, stack[top].D), weight = stack[top].weight, depth = stack[top].depth;
+			current = &branch;
+		}
+	}
+
+	void Spawn(WhittedBranch* stack, int& top, const float3 origin, const float3 direction, const float3 weight, const int depth)
+	{
+		// branches that weigh less than minWeight in every channel are dropped
+		const float3 w = fabs(weight);
+		if (max(w.x, max(w.y, w.z)) < minWeight || top == WHITTED_STACK_SIZE) return;
+		stack[top++] = { origin + direction * 0.001f, direction, weight, depth };
+	}
+
+	// light leaving one hit, except what its reflection and refraction rays
+	// bring, which are spawned with their share of the weight
+	float3 Shade(Ray& ray, int depth, const float3 weight, const Sampler& sampler, WhittedBranch* stack, int& top, WhittedShadowBatch* shadows)
+	{
+		scene->FindNearest(ray);
 		if (ray.objIdx == -1) return float3(195 / 255.0f, 251 / 255.0f, 249 / 255.0f); // or a fancy sky color
-		float3 I = ray.O + ray.t * ray.D;
-		float3 N = scene.GetNormal(ray.objIdx, I, ray.D);
-		Material material = scene.GetMaterial(ray.objIdx);
-		float3 albedo = scene.GetAlbedo(ray.objIdx, I); // very bad
+		ShadingData hit;
+		scene->GetShadingData(ray, hit);
+		const Material& material = *hit.material;
+		const float3 I = hit.I, N = hit.N, albedo = hit.albedo;
 
 		/* visualize normal */ // return (N + 1) * 0.5f;
 		/* visualize distance */ // return 0.1f * float3( ray.t, ray.t, ray.t );
@@ -27,58 +84,51 @@ public:
 		float cosI = dot(N, -ray.D);
 		float k = 1 - (((n1 / n2) * (n1 / n2)) * (1 - (cosI * cosI)));
 
+		const uint dim = SAMPLER_CAMERA_DIMS + (depth - 1) * SAMPLER_BOUNCE_DIMS;
 		if (depth > depthLimit)
 		{
-			return albedo * DirectIllumination(I, N);
+			return albedo * DirectIllumination(I, N, sampler.Get(dim + 3), shadows, weight * albedo);
 		}
 
 		// glass
 		if (material.isGlass && !(k < 0))
 		{
-			float ThetaI = acos(cosI);
-			float sinI = sin(ThetaI);
-
-			float cosT = sqrt(1 - (n1DividedByn2 * sinI));
-			float Rs = ((n1 * cosI) - (n2 * cosT)) / ((n1 * cosI) + (n2 * cosT));
-			float Rp = ((n1 * cosI) - (n2 * cosT)) / ((n1 * cosI) + (n2 * cosT));
-
-			float Fr = ((Rs * Rs) + (Rp * Rp)) / 2;
+			float Fr = BSDFUtils::Fresnel(cosI, k, n1, n2);
 			float Ft = 1 - Fr;
 
-			float p = Rand(1);
-
 			float3 reflectDirection = reflect(ray.D, N);
-			float3 reflection = albedo * Trace(Ray(I + reflectDirection * 0.001f, reflectDirection), depth + 1);
-
 			float3 refractDirection = (n1DividedByn2 * ray.D) + (N * ((n1DividedByn2 * cosI) - sqrt(k)));
-			float3 refraction = albedo * Trace(Ray(I + (refractDirection * 0.001f), refractDirection), depth + 1);
-
-			return Fr * reflection + Ft * refraction;
+			Spawn(stack, top, I, reflectDirection, weight * Fr * albedo, depth + 1);
+			Spawn(stack, top, I, refractDirection, weight * Ft * albedo, depth + 1);
+			return float3(0);
 		}
 
 		// reflection
 		if (material.isMirror || (material.isGlass && k < 0))
 		{
 			float3 reflectDirection = reflect(ray.D, N);
-			float3 reflection = albedo * Trace(Ray(I + (reflectDirection * 0.001f), reflectDirection), depth + 1);
-			return (material.reflectivity * reflection) + ((1 - material.reflectivity) * albedo * DirectIllumination(I, N));
+			Spawn(stack, top, I, reflectDirection, weight * material.reflectivity * albedo, depth + 1);
+			return (1 - material.reflectivity) * albedo * DirectIllumination(I, N, sampler.Get(dim + 3), shadows, weight * (1 - material.reflectivity) * albedo);
 		}
 
 		// diffuse
-		return albedo * DirectIllumination(I, N);
+		return albedo * DirectIllumination(I, N, sampler.Get(dim + 3), shadows, weight * albedo);
 	}
 
-	float3 DirectIllumination(float3 I, float3 N)
+	float3 DirectIllumination(float3 I, float3 N, float r, WhittedShadowBatch* shadows = 0, const float3 weight = 1)
 	{
-		float3 lightColor = scene.GetLightColor();
-		float3 lightPos = scene.GetLightPos();
+		// one light from the registry, treated as a point light at its center;
+		// with a batch, the light times weight is queued behind its shadow ray
+		float pmf;
+		int light = scene->PickLight(I, N, r, pmf);
+		if (light < 0) return float3(0);
+		float3 lightColor = scene->lights[light].emission * (scene->lights[light].area / pmf);
+		float3 lightPos = scene->GetLightPos(light);
 		float3 L = normalize(lightPos - I);
 		Ray shadowRay = Ray(I + (L * 0.001f), L);
 
 		//scene.quad.Intersect(shadowRay);
-		scene.IntersectLight(shadowRay);
-
-		if (scene.IsOccluded(shadowRay)) return float3(0);
+		scene->IntersectLight(shadowRay, light);
 
 		float d = length(lightPos - I);
 		float distF = 1 / (d * d);
@@ -87,10 +137,47 @@ public:
 		lightColor.y = lightColor.y * distF * angleF;
 		lightColor.z = lightColor.z * distF * angleF;
 
+		if (shadows)
+		{
+			shadows->queries.push_back({ shadowRay.O, shadowRay.D, weight * lightColor, shadowRay.t, (int)shadows->samples.size(), light });
+			return float3(0);
+		}
+		if (scene->IsOccluded(shadowRay)) return float3(0);
+
 		return lightColor;
 	}
 
+	void ResolveShadows(WhittedShadowBatch& batch)
+	{
+		vector<WhittedShadowQuery>& queries = batch.queries;
+		if (!useShadowPackets)
+		{
+			for (const WhittedShadowQuery& query : queries)
+			{
+				Ray shadowRay(query.O, query.D, query.dist);
+				if (!scene->IsOccluded(shadowRay)) batch.samples[query.slot] += query.contribution;
+			}
+			return;
+		}
+		// packets of rays towards the same light: their ends meet at its center
+		std::stable_sort(queries.begin(), queries.end(), [](const WhittedShadowQuery& a, const WhittedShadowQuery& b) { return a.light < b.light; });
+		Ray packet[WHITTED_PACKET_SIZE];
+		bool occluded[WHITTED_PACKET_SIZE];
+		for (int first = 0, size = (int)queries.size(); first < size; )
+		{
+			int count = 0;
+			for (; count < WHITTED_PACKET_SIZE && first + count < size && queries[first + count].light == queries[first].light; count++)
+				packet[count] = Ray(queries[first + count].O, queries[first + count].D, queries[first + count].dist);
+			scene->IsOccluded(packet, count, occluded);
+			for (int i = 0; i < count; i++) if (!occluded[i]) batch.samples[queries[first + i].slot] += queries[first + i].contribution;
+			first += count;
+		}
+	}
+
 	int depthLimit = 5;
+	float minWeight = 0.001f;	// 0 traces the full tree
+	bool deferShadows = false;		// shadow rays of a tile are traced together, after its pixels
+	bool useShadowPackets = true;	// ... in packets towards one light
 	bool isInitialized = false;
-	Scene scene;
+	Scene* scene = 0;
 };
\ No newline at end of file